@@ -0,0 +1,135 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef DHCPPACKETS_H
+#define DHCPPACKETS_H
+
+// Canned DHCP datagrams for the benchmarks
+
+#include <QByteArray>
+#include <QVector>
+#include <QtEndian>
+
+#include "pxeresponder.h"
+
+// A DHCP datagram in 4 byte aligned storage, as DHCPPacket::Parse
+// requires
+struct DHCPDatagram
+{
+    QVector<quint32> storage;
+    int size;
+
+    const char *Data() const
+    {
+        return (const char*)storage.constData();
+    }
+};
+
+inline void AppendOption(QByteArray *options, quint8 id,
+                         const QByteArray &value)
+{
+    options->append((char)id);
+    options->append((char)value.size());
+    options->append(value);
+}
+
+inline DHCPDatagram MakeDatagram(quint8 messageType, quint32 xid,
+                                 const QByteArray &classId,
+                                 const QByteArray &extraOptions)
+{
+    DHCPPacketHeader header;
+    memset(&header, 0, sizeof(header));
+    header.op = 1;
+    header.htype = 1;
+    header.hlen = 6;
+    header.xid = qToBigEndian(xid);
+    header.flags = qToBigEndian((quint16)0x8000);
+    for (int i = 0; i < 6; ++i)
+        header.chaddr[i] = (quint8)(0x52 + i + xid);
+    header.magic = qToBigEndian(0x63825363U);
+
+    QByteArray options;
+    AppendOption(&options, 53, QByteArray(1, (char)messageType));
+    // Parameter request list, as most clients send one
+    AppendOption(&options, 55, QByteArray("\x01\x03\x06\x0c\x0f\x1c"
+                                          "\x2b\x3c\x42\x43", 10));
+    if (!classId.isEmpty())
+        AppendOption(&options, 60, classId);
+    options.append(extraOptions);
+    options.append((char)255);
+
+    QByteArray packet((const char*)&header, sizeof(header));
+    packet.append(options);
+
+    DHCPDatagram datagram;
+    datagram.size = packet.size();
+    datagram.storage.resize((packet.size() + 3) / 4);
+    memcpy(datagram.storage.data(), packet.constData(), packet.size());
+
+    return datagram;
+}
+
+// DISCOVER from a BIOS PXE ROM
+inline DHCPDatagram MakePxeDiscover(quint32 xid)
+{
+    QByteArray extra;
+    // Client system architecture, network interface, machine GUID
+    AppendOption(&extra, 93, QByteArray(2, (char)0));
+    AppendOption(&extra, 94, QByteArray("\x01\x02\x01", 3));
+    AppendOption(&extra, 97, QByteArray(17, (char)0x11));
+
+    return MakeDatagram(1, xid, "PXEClient:Arch:00000:UNDI:002001", extra);
+}
+
+// REQUEST from a BIOS PXE ROM, answered with a DHCPACK
+inline DHCPDatagram MakePxeRequest(quint32 xid)
+{
+    QByteArray extra;
+    AppendOption(&extra, 93, QByteArray(2, (char)0));
+    AppendOption(&extra, 97, QByteArray(17, (char)0x11));
+
+    return MakeDatagram(3, xid, "PXEClient:Arch:00000:UNDI:002001", extra);
+}
+
+// DISCOVER from UEFI HTTP boot firmware
+inline DHCPDatagram MakeHttpClientDiscover(quint32 xid)
+{
+    QByteArray extra;
+    AppendOption(&extra, 93, QByteArray("\x00\x10", 2));
+
+    return MakeDatagram(1, xid, "HTTPClient:Arch:00016:UNDI:003001", extra);
+}
+
+// DISCOVER from an ordinary host, the bulk of what a busy LAN sends
+inline DHCPDatagram MakeHostDiscover(quint32 xid)
+{
+    QByteArray extra;
+    AppendOption(&extra, 12, "workstation-0042");
+    AppendOption(&extra, 61, QByteArray("\x01\x52\x53\x54\x55\x56\x57", 7));
+
+    return MakeDatagram(1, xid, "MSFT 5.0", extra);
+}
+
+// REQUEST without a class identifier, renewing a lease
+inline DHCPDatagram MakeHostRequest(quint32 xid)
+{
+    QByteArray extra;
+    AppendOption(&extra, 50, QByteArray("\xc0\xa8\x01\x2a", 4));
+    AppendOption(&extra, 54, QByteArray("\xc0\xa8\x01\x01", 4));
+
+    return MakeDatagram(3, xid, QByteArray(), extra);
+}
+
+#endif // DHCPPACKETS_H
@@ -0,0 +1,97 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+// Packets per second DHCPPacket can turn away or accept. Canned
+// datagrams go through Parse and IsPxeRequest the way the responder
+// looks at every broadcast on the LAN, without any socket I/O
+//
+// Usage: dhcppps [iterations]
+
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QCoreApplication>
+#include <stdio.h>
+
+#include "dhcppackets.h"
+
+static void Run(const char *name, const QVector<DHCPDatagram> &datagrams,
+                qint64 iterations)
+{
+    DHCPPacket packet;
+    QHostAddress source(QHostAddress::AnyIPv4);
+    quint64 pxe = 0;
+    int next = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    for (qint64 i = 0; i < iterations; ++i)
+    {
+        const DHCPDatagram &datagram = datagrams[next];
+        if (++next == datagrams.size())
+            next = 0;
+
+        if (packet.Parse(datagram.Data(), datagram.size, source, 68) &&
+                packet.IsPxeRequest())
+            ++pxe;
+    }
+
+    qint64 elapsed = qMax(timer.nsecsElapsed(), (qint64)1);
+
+    printf("%-14s %12.0f packets/s %8.1f ns/packet  %llu PXE\n",
+           name, iterations * 1e9 / elapsed, (double)elapsed / iterations,
+           (unsigned long long)pxe);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    qint64 iterations = 10000000;
+
+    QStringList args = app.arguments();
+    if (args.size() > 1)
+        iterations = qMax(args[1].toLongLong(), (qint64)1);
+
+    QVector<DHCPDatagram> pxe;
+    pxe.append(MakePxeDiscover(1));
+
+    QVector<DHCPDatagram> hostDiscover;
+    hostDiscover.append(MakeHostDiscover(2));
+
+    QVector<DHCPDatagram> hostRequest;
+    hostRequest.append(MakeHostRequest(3));
+
+    // Mostly other hosts, as on a LAN where a few machines boot
+    QVector<DHCPDatagram> mixed;
+    for (quint32 i = 0; i < 10; ++i)
+    {
+        if (i == 0)
+            mixed.append(MakePxeDiscover(100 + i));
+        else if (i < 7)
+            mixed.append(MakeHostDiscover(100 + i));
+        else
+            mixed.append(MakeHostRequest(100 + i));
+    }
+
+    printf("%lld iterations each\n", (long long)iterations);
+
+    Run("pxe discover", pxe, iterations);
+    Run("host discover", hostDiscover, iterations);
+    Run("host request", hostRequest, iterations);
+    Run("mixed", mixed, iterations);
+
+    return 0;
+}
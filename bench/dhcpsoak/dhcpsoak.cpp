@@ -0,0 +1,182 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+// Pushes millions of datagrams through PXEResponder::on_packet and
+// prints the resident set size as it goes, so a leak per packet
+// shows up as steady growth. The datagrams come in on a loopback
+// socket of our own, without packet info, so they are answered as
+// if they arrived on the first served interface. Replies go back
+// to 127.0.0.1. With --verbose every request is logged in detail,
+// as the responder does when started with it
+//
+// Usage: dhcpsoak [datagrams] [report interval] [--verbose]
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QFile>
+#include <QNetworkInterface>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "dhcppackets.h"
+
+// Resident set size in kilobytes, -1 if unknown
+static qint64 ResidentKb()
+{
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QFile::ReadOnly))
+        return -1;
+
+    QList<QByteArray> fields = statm.readAll().split(' ');
+    if (fields.size() < 2)
+        return -1;
+
+    return fields[1].toLongLong() * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+// The responder answers on the first interface it serves, same test
+static bool HaveServedInterface()
+{
+    QList<QNetworkInterface> all = QNetworkInterface::allInterfaces();
+
+    for (int i = 0; i < all.size(); ++i)
+    {
+        if ((all[i].flags() & QNetworkInterface::IsLoopBack) ||
+                !(all[i].flags() & QNetworkInterface::IsUp))
+            continue;
+
+        QList<QNetworkAddressEntry> entries = all[i].addressEntries();
+        for (int n = 0; n < entries.size(); ++n)
+        {
+            if (entries[n].ip().protocol() == QUdpSocket::IPv4Protocol)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    qint64 total = 5000000;
+    qint64 interval = 250000;
+
+    QStringList args = app.arguments();
+
+    bool verbose = args.removeAll("--verbose") > 0;
+
+    if (args.size() > 1)
+        total = qMax(args[1].toLongLong(), (qint64)1);
+    if (args.size() > 2)
+        interval = qMax(args[2].toLongLong(), (qint64)1);
+
+    if (!HaveServedInterface())
+    {
+        fprintf(stderr, "Needs an IPv4 interface other than loopback\n");
+        return 1;
+    }
+
+    // Port 67 can't be bound without privileges, but the interfaces
+    // and reply templates are set up before it is tried
+    PXEResponder responder("pxelinux.0");
+    responder.SetHttpBoot(8080, "ipxe/boot.ipxe");
+    responder.SetVerbose(verbose);
+    responder.init();
+
+    QUdpSocket in;
+    QUdpSocket out;
+
+    if (!in.bind(QHostAddress::LocalHost, 0) ||
+            !out.bind(QHostAddress::LocalHost, 0))
+    {
+        fprintf(stderr, "Could not bind loopback sockets\n");
+        return 1;
+    }
+
+    // Every kind of request the responder takes a different path for
+    QVector<DHCPDatagram> datagrams;
+    datagrams.append(MakePxeDiscover(1));
+    datagrams.append(MakePxeRequest(2));
+    datagrams.append(MakeHttpClientDiscover(3));
+    datagrams.append(MakeHostDiscover(4));
+    datagrams.append(MakeHostRequest(5));
+
+    // Too short to be DHCP
+    DHCPDatagram runt = MakeHostDiscover(6);
+    runt.size = 100;
+    datagrams.append(runt);
+
+    // Well under the receive buffer, none should be dropped
+    const int burst = 32;
+
+    qint64 sent = 0;
+    qint64 replies = 0;
+    int next = 0;
+    QByteArray reply(1500, 0);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    qint64 baseline = ResidentKb();
+    printf("%12s %12s %10s %10s\n", "datagrams", "replies", "rss kB",
+           "seconds");
+    printf("%12d %12d %10lld %10.1f\n", 0, 0, (long long)baseline, 0.0);
+
+    while (sent < total)
+    {
+        int count = (int)qMin((qint64)burst, total - sent);
+
+        for (int i = 0; i < count; ++i)
+        {
+            const DHCPDatagram &datagram = datagrams[next];
+            if (++next == datagrams.size())
+                next = 0;
+
+            out.writeDatagram(datagram.Data(), datagram.size,
+                              QHostAddress::LocalHost, in.localPort());
+        }
+
+        responder.on_packet(&in);
+
+        // ACKs come back to the port the request came from, offers
+        // go to 68 where nothing listens
+        while (out.hasPendingDatagrams())
+        {
+            if (out.readDatagram(reply.data(), reply.size()) > 0)
+                ++replies;
+        }
+
+        qint64 before = sent;
+        sent += count;
+
+        if (sent / interval != before / interval || sent == total)
+        {
+            printf("%12lld %12lld %10lld %10.1f\n", (long long)sent,
+                   (long long)replies, (long long)ResidentKb(),
+                   timer.elapsed() / 1000.0);
+            fflush(stdout);
+        }
+    }
+
+    qint64 growth = ResidentKb() - baseline;
+    printf("RSS grew %lld kB over %lld datagrams, %.0f datagrams/s\n",
+           (long long)growth, (long long)sent,
+           sent * 1000.0 / qMax(timer.elapsed(), (qint64)1));
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+CONFIG += console
+CONFIG += warn_on
+CONFIG += c++11
+QMAKE_CXXFLAGS += -std=c++11
+CONFIG -= app_bundle
+
+TARGET = dhcpsoak
+
+QT += network
+QT -= gui
+
+include(../../dhcp.pri)
+
+INCLUDEPATH += ..
+HEADERS += ../dhcppackets.h
+SOURCES += dhcpsoak.cpp
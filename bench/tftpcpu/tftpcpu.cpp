@@ -0,0 +1,320 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+// Server CPU time per GB sent, for the read path that copies every
+// block into a packet buffer, and the cached and memory mapped paths
+// that send straight from memory. The server runs on this thread and
+// one worker, a client thread downloads the same file over loopback
+// until enough has been sent. The client's own CPU time is taken out
+// of the total. The cache is filled in the background, the first
+// download of the cached run is sent from the mapping
+//
+// Usage: tftpcpu [GB per run] [file MB]
+
+#include <QCoreApplication>
+#include <QTemporaryDir>
+#include <QEventLoop>
+#include <QStringList>
+#include <QUdpSocket>
+#include <QThread>
+#include <QFile>
+#include <QtEndian>
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "tftpserver.h"
+
+static double CpuSeconds(int who)
+{
+    struct rusage usage;
+    getrusage(who, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Downloads a file over and over, acknowledging each window
+class Downloader : public QThread
+{
+    quint16 serverPort;
+    int blockSize;
+    int windowSize;
+    qint64 target;
+
+    QUdpSocket *sock;
+
+    bool Download();
+    void SendAck(const QHostAddress &addr, quint16 port, quint16 block);
+
+protected:
+    void run();
+
+public:
+    Downloader(quint16 serverPort, int blockSize, int windowSize,
+               qint64 target)
+        : serverPort(serverPort)
+        , blockSize(blockSize)
+        , windowSize(windowSize)
+        , target(target)
+        , sock(nullptr)
+        , received(0)
+        , cpuSeconds(0)
+        , failed(false)
+    {
+    }
+
+    // Set by run
+    qint64 received;
+    double cpuSeconds;
+    bool failed;
+};
+
+void Downloader::SendAck(const QHostAddress &addr, quint16 port,
+                         quint16 block)
+{
+    char packet[4];
+    qToBigEndian((quint16)4, (uchar*)packet);
+    qToBigEndian(block, (uchar*)packet + 2);
+    sock->writeDatagram(packet, sizeof(packet), addr, port);
+}
+
+bool Downloader::Download()
+{
+    QByteArray request;
+    request.append((char)0);
+    request.append((char)1);
+    request.append("bench.img");
+    request.append((char)0);
+    request.append("octet");
+    request.append((char)0);
+    request.append("blksize");
+    request.append((char)0);
+    request.append(QByteArray::number(blockSize));
+    request.append((char)0);
+    request.append("windowsize");
+    request.append((char)0);
+    request.append(QByteArray::number(windowSize));
+    request.append((char)0);
+    request.append("rollover");
+    request.append((char)0);
+    request.append("0");
+    request.append((char)0);
+
+    sock->writeDatagram(request, QHostAddress::LocalHost, serverPort);
+
+    QByteArray packet(65536, 0);
+    QHostAddress peerAddr;
+    quint16 peerPort = 0;
+    quint16 expected = 1;
+    int inWindow = 0;
+    int idle = 0;
+
+    for (;;)
+    {
+        if (!sock->hasPendingDatagrams() && !sock->waitForReadyRead(200))
+        {
+            if (++idle > 25 || !peerPort)
+                return false;
+
+            // Lost something, ask for the window again
+            SendAck(peerAddr, peerPort, (quint16)(expected - 1));
+            inWindow = 0;
+            continue;
+        }
+
+        QHostAddress addr;
+        quint16 port;
+        qint64 size = sock->readDatagram(packet.data(), packet.size(),
+                                         &addr, &port);
+        if (size < 4)
+            continue;
+
+        quint16 opcode = qFromBigEndian<quint16>((const uchar*)packet.data());
+        quint16 block = qFromBigEndian<quint16>(
+                    (const uchar*)packet.data() + 2);
+
+        if (opcode == 6 && !peerPort)
+        {
+            // Take the options as given, the blksize may be clamped
+            QList<QByteArray> fields = packet.left(size).mid(2).split(0);
+            for (int i = 0; i + 1 < fields.size(); i += 2)
+            {
+                if (fields[i] == "blksize")
+                    blockSize = fields[i + 1].toInt();
+                else if (fields[i] == "windowsize")
+                    windowSize = fields[i + 1].toInt();
+            }
+
+            peerAddr = addr;
+            peerPort = port;
+            SendAck(peerAddr, peerPort, 0);
+            continue;
+        }
+
+        if (opcode != 3 || port != peerPort || block != expected)
+            continue;
+
+        idle = 0;
+        received += size - 4;
+        ++expected;
+
+        bool last = (size - 4 < blockSize);
+
+        if (last || ++inWindow == windowSize)
+        {
+            SendAck(peerAddr, peerPort, block);
+            inWindow = 0;
+        }
+
+        if (last)
+            return true;
+    }
+}
+
+void Downloader::run()
+{
+    QUdpSocket socket;
+    sock = &socket;
+
+    if (!sock->bind(QHostAddress::LocalHost, 0))
+    {
+        failed = true;
+        return;
+    }
+
+    sock->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption,
+                          8 << 20);
+
+    while (received < target)
+    {
+        if (!Download())
+        {
+            failed = true;
+            break;
+        }
+    }
+
+#ifdef RUSAGE_THREAD
+    cpuSeconds = CpuSeconds(RUSAGE_THREAD);
+#endif
+}
+
+enum SendPath
+{
+    READ,
+    CACHE,
+    MAP
+};
+
+static bool Run(const QString &root, SendPath path, int blockSize,
+                int windowSize, qint64 target)
+{
+    TFTPServer server(root);
+    server.SetPort(0);
+    server.SetWorkerCount(1);
+
+    // Nothing fits, every transfer maps the file instead, or
+    // reads it when mapping is off too
+    if (path != CACHE)
+        server.SetCacheBudget(0);
+
+    server.SetMapFiles(path != READ);
+
+    server.init();
+
+    Downloader client(server.Port(), blockSize, windowSize, target);
+
+    double cpuBefore = CpuSeconds(RUSAGE_SELF);
+
+    QEventLoop loop;
+    QObject::connect(&client, SIGNAL(finished()), &loop, SLOT(quit()));
+    client.start();
+    loop.exec();
+    client.wait();
+
+    double cpu = CpuSeconds(RUSAGE_SELF) - cpuBefore - client.cpuSeconds;
+    double gb = client.received / 1e9;
+
+    if (client.failed)
+    {
+        fprintf(stderr, "Transfer failed\n");
+        return false;
+    }
+
+    static const char *const names[] = { "read", "cache", "map" };
+
+    printf("%-6s %7d %6d %10.2f %12.3f\n", names[path],
+           blockSize, windowSize, gb, cpu / gb);
+    fflush(stdout);
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    qint64 target = Q_INT64_C(1000000000);
+    qint64 fileSize = 48 << 20;
+
+    QStringList args = app.arguments();
+    if (args.size() > 1)
+        target = (qint64)(args[1].toDouble() * 1e9);
+    if (args.size() > 2)
+        fileSize = args[2].toLongLong() << 20;
+
+    QTemporaryDir root;
+    if (!root.isValid())
+        return 1;
+
+    // Real data, so the mapped path reads it from the page cache,
+    // small enough to fit the default cache budget
+    QFile file(root.path() + "/bench.img");
+    if (!file.open(QFile::WriteOnly))
+        return 1;
+
+    QByteArray chunk(1 << 20, 0);
+    for (int i = 0; i < chunk.size(); ++i)
+        chunk[i] = (char)(i * 131 + 7);
+    for (qint64 written = 0; written < fileSize; written += chunk.size())
+        file.write(chunk);
+    file.close();
+
+    // Only world readable files are served
+    file.setPermissions(file.permissions() | QFile::ReadOther);
+
+    printf("%-6s %7s %6s %10s %12s\n", "path", "blksize", "window",
+           "GB", "CPU s/GB");
+
+    static const int blockSizes[] = { 1428, 8192, 65464 };
+
+    // The read path first, the baseline for the other two
+    for (int path = READ; path <= MAP; ++path)
+    {
+        for (unsigned i = 0; i < sizeof(blockSizes) / sizeof(*blockSizes); ++i)
+        {
+            // Windows of about 96KB, which a default receive buffer
+            // holds without dropping
+            int windowSize = qMax(1, (96 << 10) / blockSizes[i]);
+
+            if (!Run(root.path(), SendPath(path), blockSizes[i],
+                     windowSize, target))
+                return 1;
+        }
+    }
+
+    return 0;
+}
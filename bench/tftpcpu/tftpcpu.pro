@@ -0,0 +1,14 @@
+CONFIG += console
+CONFIG += warn_on
+CONFIG += c++11
+QMAKE_CXXFLAGS += -std=c++11
+CONFIG -= app_bundle
+
+TARGET = tftpcpu
+
+QT += network
+QT -= gui
+
+include(../../tftp.pri)
+
+SOURCES += tftpcpu.cpp
@@ -0,0 +1,6 @@
+# The DHCP responder without the user interface, for the benchmark
+# targets
+INCLUDEPATH += $$PWD
+
+SOURCES += $$PWD/pxeresponder.cpp $$PWD/udpbatch.cpp
+HEADERS += $$PWD/pxeresponder.h $$PWD/udpbatch.h
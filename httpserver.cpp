@@ -0,0 +1,493 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "httpserver.h"
+#include "tftppathindex.h"
+
+#include <QList>
+#include <QNetworkInterface>
+
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#include <errno.h>
+#endif
+
+HTTPConnection::HTTPConnection(QTcpSocket *sock, TFTPPathIndex *index,
+                               QObject *parent)
+    : QObject(parent)
+    , sock(sock)
+    , index(index)
+    , keepAlive(true)
+    , file(nullptr)
+    , sendOffset(0)
+    , sendEnd(0)
+    , idleTimer(new QTimer(this))
+{
+    sock->setParent(this);
+
+    connect(sock, SIGNAL(readyRead()), this, SLOT(OnReadyRead()));
+    connect(sock, SIGNAL(bytesWritten(qint64)), this, SLOT(OnBytesWritten()));
+    connect(sock, SIGNAL(disconnected()), this, SLOT(deleteLater()));
+
+    idleTimer->setSingleShot(true);
+    connect(idleTimer, SIGNAL(timeout()), this, SLOT(OnIdleTimeout()));
+    idleTimer->start(idleTimeout);
+}
+
+void HTTPConnection::OnReadyRead()
+{
+    received.append(sock->readAll());
+    idleTimer->start(idleTimeout);
+
+    ProcessRequests();
+}
+
+void HTTPConnection::ProcessRequests()
+{
+    // The next request waits until the current body is out
+    while (!file && keepAlive)
+    {
+        int end = received.indexOf("\r\n\r\n");
+
+        if (end < 0)
+        {
+            if (received.size() > maxHeaderSize)
+            {
+                keepAlive = false;
+                SendStatus(431, "Request Header Fields Too Large");
+                sock->disconnectFromHost();
+            }
+            return;
+        }
+
+        QByteArray head = received.left(end);
+        received.remove(0, end + 4);
+
+        HandleRequest(head);
+    }
+
+    if (!file && !keepAlive)
+        sock->disconnectFromHost();
+}
+
+void HTTPConnection::SendStatus(int status, const char *reason,
+                                const QByteArray &extraHeaders)
+{
+    QByteArray response;
+    response.append(QString("HTTP/1.1 %1 %2\r\n").arg(status).arg(reason)
+                    .toLatin1());
+    response.append("Content-Length: 0\r\n");
+    response.append(extraHeaders);
+    response.append(keepAlive ? "Connection: keep-alive\r\n" :
+                                "Connection: close\r\n");
+    response.append("\r\n");
+
+    sock->write(response);
+}
+
+int HTTPConnection::ParseRange(const QByteArray &value, qint64 size,
+                               qint64 *first, qint64 *last)
+{
+    QByteArray spec = value.trimmed();
+
+    // Several ranges would need a multipart body, send it all instead
+    if (!spec.startsWith("bytes=") || spec.contains(','))
+        return 0;
+
+    spec = spec.mid(6);
+
+    int dash = spec.indexOf('-');
+    if (dash < 0)
+        return 0;
+
+    QByteArray start = spec.left(dash).trimmed();
+    QByteArray end = spec.mid(dash + 1).trimmed();
+    bool ok;
+
+    if (start.isEmpty())
+    {
+        // The last n bytes
+        qint64 suffix = end.toLongLong(&ok);
+        if (!ok || suffix < 0)
+            return 0;
+        if (suffix == 0 || size == 0)
+            return -1;
+
+        *first = qMax((qint64)0, size - suffix);
+        *last = size - 1;
+        return 1;
+    }
+
+    *first = start.toLongLong(&ok);
+    if (!ok || *first < 0)
+        return 0;
+
+    if (end.isEmpty())
+    {
+        *last = size - 1;
+    }
+    else
+    {
+        *last = end.toLongLong(&ok);
+        if (!ok || *last < *first)
+            return 0;
+    }
+
+    if (*first >= size)
+        return -1;
+
+    *last = qMin(*last, size - 1);
+    return 1;
+}
+
+void HTTPConnection::HandleRequest(const QByteArray &head)
+{
+    QList<QByteArray> lines = head.split('\n');
+    QList<QByteArray> requestLine = lines[0].trimmed().split(' ');
+
+    if (requestLine.size() != 3)
+    {
+        keepAlive = false;
+        SendStatus(400, "Bad Request");
+        return;
+    }
+
+    const QByteArray &method = requestLine[0];
+    QByteArray target = requestLine[1];
+    const QByteArray &version = requestLine[2];
+
+    QByteArray connection;
+    QByteArray range;
+
+    for (int i = 1; i < lines.size(); ++i)
+    {
+        int colon = lines[i].indexOf(':');
+        if (colon < 0)
+            continue;
+
+        QByteArray name = lines[i].left(colon).trimmed().toLower();
+        QByteArray value = lines[i].mid(colon + 1).trimmed();
+
+        if (name == "connection")
+            connection = value.toLower();
+        else if (name == "range")
+            range = value;
+    }
+
+    // Persistent by default from HTTP/1.1 on
+    if (version == "HTTP/1.1")
+        keepAlive = !connection.contains("close");
+    else
+        keepAlive = connection.contains("keep-alive");
+
+    bool headOnly = (method == "HEAD");
+
+    if (method != "GET" && !headOnly)
+    {
+        SendStatus(501, "Not Implemented");
+        return;
+    }
+
+    // The query string means nothing here
+    int query = target.indexOf('?');
+    if (query >= 0)
+        target.truncate(query);
+
+    target = QByteArray::fromPercentEncoding(target);
+
+    QString path;
+    if (!index->Resolve(target.constData(), &path))
+    {
+        emit verboseEvent(QString("HTTP: %1 not found")
+                          .arg(QString::fromUtf8(target)));
+        SendStatus(404, "Not Found");
+        return;
+    }
+
+    file = new QFile(path, this);
+
+    // Same rule as TFTP, the file must be world readable
+    if (!file->open(QFile::ReadOnly) ||
+            (file->permissions() & QFile::ReadOther) == 0)
+    {
+        delete file;
+        file = nullptr;
+        SendStatus(403, "Forbidden");
+        return;
+    }
+
+    qint64 size = file->size();
+    qint64 first = 0;
+    qint64 last = size - 1;
+
+    int ranged = range.isEmpty() ? 0 : ParseRange(range, size, &first, &last);
+
+    if (ranged < 0)
+    {
+        delete file;
+        file = nullptr;
+        SendStatus(416, "Range Not Satisfiable",
+                   QString("Content-Range: bytes */%1\r\n").arg(size)
+                   .toLatin1());
+        return;
+    }
+
+    QByteArray response;
+
+    if (ranged > 0)
+    {
+        response.append("HTTP/1.1 206 Partial Content\r\n");
+        response.append(QString("Content-Range: bytes %1-%2/%3\r\n")
+                        .arg(first).arg(last).arg(size).toLatin1());
+    }
+    else
+    {
+        response.append("HTTP/1.1 200 OK\r\n");
+    }
+
+    response.append(QString("Content-Length: %1\r\n")
+                    .arg(last - first + 1).toLatin1());
+    response.append("Content-Type: application/octet-stream\r\n");
+    response.append("Accept-Ranges: bytes\r\n");
+    response.append(keepAlive ? "Connection: keep-alive\r\n" :
+                                "Connection: close\r\n");
+    response.append("\r\n");
+
+    sock->write(response);
+
+    emit verboseEvent(QString("HTTP: %1 %2 bytes %3-%4 to %5")
+                      .arg(QString::fromLatin1(method))
+                      .arg(path).arg(first).arg(last)
+                      .arg(sock->peerAddress().toString()));
+
+    if (headOnly || first > last)
+    {
+        FinishBody();
+        return;
+    }
+
+    sendOffset = first;
+    sendEnd = last + 1;
+
+    SendBody();
+}
+
+void HTTPConnection::SendBody()
+{
+    // The headers, or a fallback chunk, are still in the socket's
+    // own buffer. Nothing may overtake them
+    if (sock->bytesToWrite() > 0)
+        return;
+
+#ifdef Q_OS_LINUX
+    // Straight from the page cache to the socket
+    for (int chunk = 0; chunk < maxChunks && sendOffset < sendEnd; ++chunk)
+    {
+        off_t offset = sendOffset;
+        ssize_t sent = sendfile(sock->socketDescriptor(), file->handle(),
+                                &offset, qMin(chunkSize, sendEnd - sendOffset));
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+
+        // The socket is full. QTcpSocket has its own notifiers on the
+        // descriptor and knows nothing about sendfile, so hand it one
+        // chunk. Its bytesWritten brings us back once there is room
+        if (sent < 0 && errno == EAGAIN)
+        {
+            WriteChunk(bufferedChunkSize);
+            return;
+        }
+
+        if (sent <= 0)
+        {
+            // Failed, or the file got shorter under us. The length is
+            // already promised, all that can be done is close
+            emit errorEvent(QString("HTTP: sendfile failed for %1")
+                            .arg(file->fileName()));
+            sock->abort();
+            return;
+        }
+
+        sendOffset += sent;
+    }
+
+    // Other connections get a turn before the rest
+    if (sendOffset < sendEnd)
+    {
+        QMetaObject::invokeMethod(this, "ContinueBody", Qt::QueuedConnection);
+        return;
+    }
+#else
+    // Through the socket's buffer, one chunk at a time
+    if (sendOffset < sendEnd)
+    {
+        WriteChunk(chunkSize);
+        return;
+    }
+#endif
+
+    FinishBody();
+}
+
+bool HTTPConnection::WriteChunk(qint64 size)
+{
+    file->seek(sendOffset);
+    QByteArray chunk = file->read(qMin(size, sendEnd - sendOffset));
+
+    if (chunk.isEmpty())
+    {
+        emit errorEvent(QString("HTTP: Read failed for %1")
+                        .arg(file->fileName()));
+        sock->abort();
+        return false;
+    }
+
+    sendOffset += chunk.size();
+    sock->write(chunk);
+    return true;
+}
+
+void HTTPConnection::FinishBody()
+{
+    delete file;
+    file = nullptr;
+
+    idleTimer->start(idleTimeout);
+
+    // Pipelined requests, or close if this was the last one
+    ProcessRequests();
+}
+
+void HTTPConnection::OnBytesWritten()
+{
+    if (file && sock->bytesToWrite() == 0)
+        SendBody();
+}
+
+void HTTPConnection::ContinueBody()
+{
+    if (file)
+        SendBody();
+}
+
+void HTTPConnection::OnIdleTimeout()
+{
+    // A slow body is not idle
+    if (file)
+    {
+        idleTimer->start(idleTimeout);
+        return;
+    }
+
+    sock->disconnectFromHost();
+}
+
+HTTPServer::HTTPServer(TFTPPathIndex *index, quint16 port, QObject *parent)
+    : QObject(parent)
+    , index(index)
+    , port(port)
+{
+}
+
+quint16 HTTPServer::Port() const
+{
+    return listeners.isEmpty() ? port : listeners[0]->serverPort();
+}
+
+void HTTPServer::SetInterfaces(const QStringList &names)
+{
+    allowedInterfaces = names;
+}
+
+bool HTTPServer::Listen(const QHostAddress &addr)
+{
+    QTcpServer *listener = new QTcpServer(this);
+
+    if (!listener->listen(addr, port))
+    {
+        emit errorEvent(QString("HTTP: Failed to listen on %1 port %2: %3")
+                        .arg(addr.toString()).arg(port)
+                        .arg(listener->errorString()));
+        delete listener;
+        return false;
+    }
+
+    connect(listener, SIGNAL(newConnection()), this, SLOT(OnNewConnection()));
+    listeners.append(listener);
+
+    emit verboseEvent(QString("HTTP: Listening on %1 port %2")
+                      .arg(addr.toString()).arg(port));
+    return true;
+}
+
+bool HTTPServer::init()
+{
+    if (allowedInterfaces.isEmpty())
+        return Listen(QHostAddress::Any);
+
+    // The addresses the DHCP responder serves and hands out URLs for
+    QList<QNetworkInterface> all = QNetworkInterface::allInterfaces();
+
+    for (int i = 0; i < all.size(); ++i)
+    {
+        const QNetworkInterface &iface = all[i];
+
+        if ((iface.flags() & QNetworkInterface::IsLoopBack) ||
+                !(iface.flags() & QNetworkInterface::IsUp))
+            continue;
+
+        QList<QNetworkAddressEntry> entries = iface.addressEntries();
+
+        for (int n = 0; n < entries.size(); ++n)
+        {
+            QHostAddress addr = entries[n].ip();
+
+            if (addr.protocol() != QAbstractSocket::IPv4Protocol)
+                continue;
+
+            if (!allowedInterfaces.contains(iface.name()) &&
+                    !allowedInterfaces.contains(addr.toString()))
+                continue;
+
+            Listen(addr);
+        }
+    }
+
+    if (listeners.isEmpty())
+    {
+        emit errorEvent("HTTP: None of the interfaces could be served");
+        return false;
+    }
+
+    return true;
+}
+
+void HTTPServer::OnNewConnection()
+{
+    for (int i = 0; i < listeners.size(); ++i)
+    {
+        while (QTcpSocket *sock = listeners[i]->nextPendingConnection())
+        {
+            HTTPConnection *connection = new HTTPConnection(sock, index,
+                                                            this);
+
+            connect(connection, SIGNAL(verboseEvent(QString)),
+                    this, SIGNAL(verboseEvent(QString)));
+            connect(connection, SIGNAL(errorEvent(QString)),
+                    this, SIGNAL(errorEvent(QString)));
+        }
+    }
+}
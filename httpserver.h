@@ -0,0 +1,121 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QStringList>
+#include <QFile>
+#include <QTimer>
+
+class TFTPPathIndex;
+
+// One client connection, requests are handled one after another
+// for as long as the client keeps it alive
+class HTTPConnection : public QObject
+{
+    Q_OBJECT
+
+    QTcpSocket *sock;
+    TFTPPathIndex *index;
+
+    // Received and not handled yet, may hold pipelined requests
+    QByteArray received;
+    bool keepAlive;
+
+    // Body being sent, [sendOffset, sendEnd) of the file
+    QFile *file;
+    qint64 sendOffset;
+    qint64 sendEnd;
+
+    QTimer *idleTimer;
+
+    static const int maxHeaderSize = 16384;
+    static const int idleTimeout = 30000;
+    static const qint64 chunkSize = 1024 * 1024;
+
+    // Chunks per event loop pass, other connections get a turn
+    static const int maxChunks = 8;
+
+    // Written through the socket's buffer when sendfile finds it
+    // full, the socket tells us with bytesWritten once it has room
+    static const qint64 bufferedChunkSize = 64 * 1024;
+
+    void ProcessRequests();
+    void HandleRequest(const QByteArray &head);
+    void SendStatus(int status, const char *reason,
+                    const QByteArray &extraHeaders = QByteArray());
+    void SendBody();
+    bool WriteChunk(qint64 size);
+    void FinishBody();
+
+    // 1 if value is a single satisfiable range, -1 if unsatisfiable,
+    // 0 if it is to be ignored
+    static int ParseRange(const QByteArray &value, qint64 size,
+                          qint64 *first, qint64 *last);
+
+public:
+    HTTPConnection(QTcpSocket *sock, TFTPPathIndex *index,
+                   QObject *parent = 0);
+
+signals:
+    void verboseEvent(const QString &msg);
+    void errorEvent(const QString &msg);
+
+private slots:
+    void OnReadyRead();
+    void OnBytesWritten();
+    void ContinueBody();
+    void OnIdleTimeout();
+};
+
+// Serves the TFTP root over HTTP/1.1, for iPXE and UEFI HTTP boot.
+// GET and HEAD only, with keep-alive and single byte ranges
+class HTTPServer : public QObject
+{
+    Q_OBJECT
+
+    // One per served address, or one for all of them
+    QList<QTcpServer*> listeners;
+    TFTPPathIndex *index;
+    quint16 port;
+    QStringList allowedInterfaces;
+
+    bool Listen(const QHostAddress &addr);
+
+public:
+    HTTPServer(TFTPPathIndex *index, quint16 port, QObject *parent = 0);
+    bool init();
+
+    // The port given, or the one picked for port 0 once init has
+    // listened
+    quint16 Port() const;
+
+    // Listen only on these interfaces, by name or address, the same
+    // as the DHCP responder. Empty listens on all. Call before init
+    void SetInterfaces(const QStringList &names);
+
+signals:
+    void verboseEvent(const QString &msg);
+    void errorEvent(const QString &msg);
+
+private slots:
+    void OnNewConnection();
+};
+
+#endif // HTTPSERVER_H
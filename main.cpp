@@ -51,10 +51,122 @@ int main(int argc, char *argv[])
     if (opt != -1 && opt + 1 < args.size())
         bootFile = args[opt+1];
 
+    // Boot file cache budget in megabytes
+    qint64 cacheSize = -1;
+    opt = args.indexOf("--cachesize");
+    if (opt != -1 && opt + 1 < args.size())
+        cacheSize = args[opt+1].toLongLong();
+
+    // TFTP worker threads, 0 runs transfers on the main thread
+    int workers = -1;
+    opt = args.indexOf("--workers");
+    if (opt != -1 && opt + 1 < args.size())
+        workers = args[opt+1].toInt();
+
+    // Carry all transfers over a few shared sockets
+    bool multiplexed = args.contains("--multiplex");
+
+    // RFC 2090 multicast, first group address to hand out
+    QHostAddress multicastBase;
+    opt = args.indexOf("--multicast");
+    if (opt != -1 && opt + 1 < args.size())
+        multicastBase = QHostAddress(args[opt+1]);
+
+    // Seconds a TFTP transfer may go without progress
+    int idleTimeout = -1;
+    opt = args.indexOf("--idletimeout");
+    if (opt != -1 && opt + 1 < args.size())
+        idleTimeout = args[opt+1].toInt();
+
+    // Finished TFTP transfers kept for reuse, preallocated at startup
+    int poolSize = -1;
+    opt = args.indexOf("--poolsize");
+    if (opt != -1 && opt + 1 < args.size())
+        poolSize = args[opt+1].toInt();
+
+    // Concurrent TFTP transfers, in total and per client
+    int maxSessions = 0;
+    opt = args.indexOf("--maxsessions");
+    if (opt != -1 && opt + 1 < args.size())
+        maxSessions = args[opt+1].toInt();
+
+    int maxClientSessions = TFTPServer::defaultMaxClientSessions;
+    opt = args.indexOf("--maxclientsessions");
+    if (opt != -1 && opt + 1 < args.size())
+        maxClientSessions = args[opt+1].toInt();
+
+    // TFTP bandwidth in kilobytes per second, in total and per client
+    qint64 rateLimit = 0;
+    opt = args.indexOf("--ratelimit");
+    if (opt != -1 && opt + 1 < args.size())
+        rateLimit = args[opt+1].toLongLong();
+
+    qint64 clientRateLimit = 0;
+    opt = args.indexOf("--clientratelimit");
+    if (opt != -1 && opt + 1 < args.size())
+        clientRateLimit = args[opt+1].toLongLong();
+
+    // Send DATA for the transfers with the least left first
+    bool shortestFirst = args.contains("--shortestfirst");
+
+    // HTTP boot for iPXE and UEFI clients, off unless a port is given
+    int httpPort = 0;
+    opt = args.indexOf("--http");
+    if (opt != -1 && opt + 1 < args.size())
+        httpPort = args[opt+1].toInt();
+
+    // What iPXE and UEFI HTTP clients load, no URLs are handed out
+    // without it
+    QString httpBootFile;
+    opt = args.indexOf("--httpbootfile");
+    if (opt != -1 && opt + 1 < args.size())
+        httpBootFile = args[opt+1];
+
+    // Comma separated interface names or addresses, all when not given
+    QStringList interfaces;
+    opt = args.indexOf("--interfaces");
+    if (opt != -1 && opt + 1 < args.size())
+        interfaces = args[opt+1].split(',', QString::SkipEmptyParts);
+
+    // Point PXE clients at a boot server on UDP 4011
+    bool bootServer = args.contains("--bootserver");
+
+    // Log every DHCP request and TFTP packet, not just each transfer
+    bool verbose = args.contains("--verbose");
+
     signal(SIGINT, OnControlCSignal);
 
     PXEService s(serverRoot, bootFile, &a);
 
+    if (cacheSize >= 0)
+        s.tftp()->SetCacheBudget(cacheSize * 1024 * 1024);
+
+    if (workers >= 0)
+        s.tftp()->SetWorkerCount(workers);
+
+    s.tftp()->SetMultiplexed(multiplexed);
+
+    if (idleTimeout > 0)
+        s.tftp()->SetMaxIdleTime(idleTimeout * 1000);
+
+    if (poolSize >= 0)
+        s.tftp()->SetPoolSize(poolSize);
+
+    s.tftp()->SetShortestFirst(shortestFirst);
+    s.tftp()->SetVerbose(verbose);
+    s.tftp()->SetMaxSessions(maxSessions, maxClientSessions);
+    s.tftp()->SetRateLimit(rateLimit * 1024, clientRateLimit * 1024);
+
+    if (!multicastBase.isNull())
+        s.tftp()->SetMulticast(multicastBase, 1758);
+
+    if (httpPort > 0)
+        s.SetHttpBoot(httpPort, httpBootFile);
+
+    s.SetInterfaces(interfaces);
+    s.dhcp()->SetBootServer(bootServer);
+    s.dhcp()->SetVerbose(verbose);
+
     MainWindow mw;
     mw.show();
 
@@ -3,8 +3,8 @@ CONFIG += console
 CONFIG += warn_on
 CONFIG += c++11
 QMAKE_CXXFLAGS += -std=c++11
-SOURCES = main.cpp mainwindow.cpp pxeresponder.cpp pxeservice.cpp tftpserver.cpp tftptransfer.cpp
-HEADERS = mainwindow.h pxeresponder.h pxeservice.h tftpserver.h tftptransfer.h
+SOURCES = main.cpp mainwindow.cpp pxeresponder.cpp pxeservice.cpp tftpserver.cpp tftptransfer.cpp tftpfilecache.cpp tftpmultiplexer.cpp udpbatch.cpp tftpmulticast.cpp tftpreadahead.cpp tftptimerwheel.cpp tftpsessiontable.cpp tftprequest.cpp tftpsessionpool.cpp tftpratelimiter.cpp tftpsendscheduler.cpp tftppathindex.cpp httpserver.cpp
+HEADERS = mainwindow.h pxeresponder.h pxeservice.h tftpserver.h tftptransfer.h tftpfilecache.h tftpmultiplexer.h udpbatch.h tftpmulticast.h tftpreadahead.h tftptimerwheel.h tftpsessiontable.h tftprequest.h tftpsessionpool.h tftpratelimiter.h tftpsendscheduler.h tftppathindex.h httpserver.h
 FORMS = mainwindow.ui
 QT += network
 
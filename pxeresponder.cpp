@@ -27,47 +27,101 @@ bool DHCPPacketHeader::IsValid() const
     return magic == qToBigEndian(0x63825363U);
 }
 
+DHCPPacket::DHCPPacket()
+    : packet(nullptr)
+    , packetSize(0)
+    , header(nullptr)
+    , indexed(false)
+    , sourcePort(0)
+{
+}
+
 quint32 DHCPPacket::TransactionId() const
 {
-    return header.xid;
+    return header->xid;
+}
+
+quint16 DHCPPacket::Flags() const
+{
+    return header->flags;
 }
 
 void DHCPPacket::CopyHardwareAddrTo(DHCPPacketHeader &dest) const
 {
-    std::copy(std::begin(header.chaddr), 
-              std::end(header.chaddr), std::begin(dest.chaddr));
+    std::copy(std::begin(header->chaddr),
+              std::end(header->chaddr), std::begin(dest.chaddr));
 }
 
-DHCPPacket::OptionMap DHCPPacket::ParseOptions(
-        quint8 *options, quint32 options_len)
+void DHCPPacket::BuildIndex() const
 {
-    OptionMap result;
+    std::fill(std::begin(present), std::end(present), 0);
 
-    quint8 *options_end = (quint8 *)options + options_len;
+    const quint8 *p = packet + sizeof(DHCPPacketHeader);
+    const quint8 *options_end = packet + packetSize;
 
-    // We loop until p + 1 < options because we must read the length byte
-    for (quint8 *p = options; *p != 255 && p + 1 < options_end; )
+    while (p < options_end && *p != 255)
     {
         quint8 option_id = p[0];
-        quint8 option_len = p[1];
 
-        // Skip option id and length
-        p += 2;
+        // Pad has no length byte
+        if (option_id == 0)
+        {
+            ++p;
+            continue;
+        }
 
-        // If length causes overrun, break
-        if (p + option_len > options_end)
+        // Length must be there, and must not overrun
+        if (p + 2 > options_end || p + 2 + p[1] > options_end)
             break;
 
-        OptionData option_payload(option_len);
-        std::copy(p, p + option_len, option_payload.begin());
+        // A repeated option replaces the earlier one
+        present[option_id >> 5] |= 1U << (option_id & 31);
+        optionOffset[option_id] = p + 2 - packet;
+        optionLength[option_id] = p[1];
+
+        p += 2 + p[1];
+    }
 
-        if (option_id != 0)
-            result.insert(option_id, option_payload);
+    indexed = true;
+}
 
-        p += option_len;
+bool DHCPPacket::FindOption(quint8 option_id, OptionData *result) const
+{
+    if (indexed)
+    {
+        if (!OptionExists(option_id))
+            return false;
+
+        *result = OptionContent(option_id);
+        return true;
     }
 
-    return result;
+    // Walk only as far as the option, without indexing the rest
+    const quint8 *p = packet + sizeof(DHCPPacketHeader);
+    const quint8 *options_end = packet + packetSize;
+
+    while (p < options_end && *p != 255)
+    {
+        if (p[0] == 0)
+        {
+            ++p;
+            continue;
+        }
+
+        if (p + 2 > options_end || p + 2 + p[1] > options_end)
+            break;
+
+        if (p[0] == option_id)
+        {
+            result->data = p + 2;
+            result->size = p[1];
+            return true;
+        }
+
+        p += 2 + p[1];
+    }
+
+    return false;
 }
 
 QString DHCPPacket::LookupOptionName(quint8 id) const
@@ -96,21 +150,36 @@ bool DHCPPacket::Read(QUdpSocket *socket)
     if (packet_len < 0)
         return false;
 
-    // Packet must be at least the size of a DHCP header
-    if (packet_len < (int)sizeof(header))
-        return false;
+    // Grows to the largest datagram seen, then stays
+    if (readBuffer.size() < packet_len)
+        readBuffer.resize(packet_len);
 
-    buffer.resize(packet_len);
-    if (socket->readDatagram((char *)buffer.data(), packet_len,
-            &sourceAddress, &sourcePort) != packet_len)
+    QHostAddress addr;
+    quint16 port;
+    if (socket->readDatagram(readBuffer.data(), packet_len,
+            &addr, &port) != packet_len)
         return false;
 
-    memcpy(&header, buffer.data(), sizeof(header));
-    if (!header.IsValid())
+    return Parse(readBuffer.constData(), packet_len, addr, port);
+}
+
+bool DHCPPacket::Parse(const char *data, int packet_len,
+        const QHostAddress &addr, quint16 port)
+{
+    sourceAddress = addr;
+    sourcePort = port;
+
+    packet = (const quint8 *)data;
+    packetSize = packet_len;
+    header = (const DHCPPacketHeader *)data;
+    indexed = false;
+
+    // Packet must be at least the size of a DHCP header
+    if (packet_len < (int)sizeof(DHCPPacketHeader))
         return false;
 
-    options = ParseOptions(buffer.data() + sizeof(DHCPPacketHeader),
-            packet_len - sizeof(DHCPPacketHeader));
+    if (!header->IsValid())
+        return false;
 
     return true;
 }
@@ -127,27 +196,48 @@ quint16 DHCPPacket::GetSourcePort() const
 
 bool DHCPPacket::IsPxeRequest() const
 {
-    OptionMap::const_iterator i = options.find(60);
-    if (i == options.end())
+    OptionData data;
+    if (!FindOption(60, &data))
         return false;
 
-    if (i.value().size() >= 9 && !memcmp(i.value().data(), "PXEClient", 9))
+    if (data.size >= 9 && !memcmp(data.data, "PXEClient", 9))
         return true;
 
     return false;
 }
 
+bool DHCPPacket::IsHttpClient() const
+{
+    OptionData data;
+    if (!FindOption(60, &data))
+        return false;
+
+    return data.size >= 10 && !memcmp(data.data, "HTTPClient", 10);
+}
+
+bool DHCPPacket::IsIpxe() const
+{
+    if (OptionExists(175))
+        return true;
+
+    if (!OptionExists(77))
+        return false;
+
+    OptionData data = OptionContent(77);
+    return data.size == 4 && !memcmp(data.data, "iPXE", 4);
+}
+
 quint8 DHCPPacket::GetMessageType() const
 {
     if (!OptionExists(53))
         return false;
 
-    const OptionData &data = OptionContent(53);
+    OptionData data = OptionContent(53);
 
-    if (data.size() < 1)
+    if (data.size < 1)
         return false;
 
-    return data[0];
+    return data.data[0];
 }
 
 bool DHCPPacket::IsMessageType(quint8 type) const
@@ -167,62 +257,78 @@ bool DHCPPacket::IsDhcpRequest() const
 
 bool DHCPPacket::OptionExists(quint8 option_id) const
 {
-    return options.find(option_id) != options.end();
+    if (!indexed)
+        BuildIndex();
+
+    return (present[option_id >> 5] >> (option_id & 31)) & 1;
 }
 
-const DHCPPacket::OptionData &DHCPPacket::OptionContent(quint8 option_id) const
+DHCPPacket::OptionData DHCPPacket::OptionContent(quint8 option_id) const
 {
-    OptionMap::const_iterator i = options.find(option_id);
-    return i.value();
+    OptionData result;
+
+    if (!OptionExists(option_id))
+    {
+        result.data = nullptr;
+        result.size = 0;
+        return result;
+    }
+
+    result.data = packet + optionOffset[option_id];
+    result.size = optionLength[option_id];
+    return result;
 }
 
 QList<QString> DHCPPacket::PacketDetailDump() const
 {
     QList<QString> r;
 
-    r.append(header.op ? "BOOTREQUEST" : "BOOTREPLY");
-    r.append(header.htype == 1? "Using MAC addresses" : "Unknown address type");
-    r.append(QString("Address length: %1").arg(header.hlen));
-    r.append(QString("Hops: %1").arg(header.hops));
+    r.append(header->op ? "BOOTREQUEST" : "BOOTREPLY");
+    r.append(header->htype == 1? "Using MAC addresses" : "Unknown address type");
+    r.append(QString("Address length: %1").arg(header->hlen));
+    r.append(QString("Hops: %1").arg(header->hops));
     r.append(QString("Transaction id: 0x%1")
-             .arg((uint)header.xid, 8, 16, QChar('0')));
+             .arg((uint)header->xid, 8, 16, QChar('0')));
     r.append(QString("Seconds since transaction start: %1")
-             .arg(qFromBigEndian((header.secs))));
-    r.append(QString("Flags: %1").arg(header.flags, 4, 16, QChar('0')));
-    r.append(QString("Client IP address: 0x%1").arg(header.ciaddr, 8, 16, QChar('0')));
-    r.append(QString("Your IP address: 0x%1").arg(header.yiaddr, 8, 16, QChar('0')));
-    r.append(QString("Next server: 0x%1").arg(header.siaddr, 8, 16, QChar('0')));
-    r.append(QString("Relay agent IP: 0x%1").arg(header.giaddr, 8, 16, QChar('0')));
+             .arg(qFromBigEndian((header->secs))));
+    r.append(QString("Flags: %1").arg(header->flags, 4, 16, QChar('0')));
+    r.append(QString("Client IP address: 0x%1").arg(header->ciaddr, 8, 16, QChar('0')));
+    r.append(QString("Your IP address: 0x%1").arg(header->yiaddr, 8, 16, QChar('0')));
+    r.append(QString("Next server: 0x%1").arg(header->siaddr, 8, 16, QChar('0')));
+    r.append(QString("Relay agent IP: 0x%1").arg(header->giaddr, 8, 16, QChar('0')));
 
     {
         QString hardwareAddr;
         hardwareAddr.append("Client addr: ");
-        for (int i = 0; i < header.hlen; ++i)
+        for (int i = 0; i < header->hlen; ++i)
         {
             hardwareAddr.append(QString("%1")
-                .arg(header.chaddr[i], 2, 16, QChar('0')));
-            if (i != header.hlen-1)
+                .arg(header->chaddr[i], 2, 16, QChar('0')));
+            if (i != header->hlen-1)
                 hardwareAddr.append(':');
         }
         r.append(hardwareAddr);
     }
 
-    r.append(QString("Server host name: %1").arg((char*)header.sname));
-    r.append(QString("Boot file: %1").arg((char*)header.file));
+    r.append(QString("Server host name: %1").arg((char*)header->sname));
+    r.append(QString("Boot file: %1").arg((char*)header->file));
 
-    for (OptionMap::ConstIterator i = options.begin(); i != options.end(); ++i)
+    for (int id = 1; id < 255; ++id)
     {
-        const OptionData &data = i.value();
+        if (!OptionExists(id))
+            continue;
+
+        OptionData data = OptionContent(id);
 
         r.append(QString("Option %1, length %2, %3")
-                 .arg((uint)i.key())
-                 .arg(data.size())
-                 .arg(LookupOptionName(i.key())));
+                 .arg(id)
+                 .arg(data.size)
+                 .arg(LookupOptionName(id)));
 
         QString option_content(" ");
-        for (int i = 0; i < data.size(); ++i)
+        for (int i = 0; i < data.size; ++i)
         {
-            option_content.append(QString("%1 ").arg((uint)data[i], 2, 16, QChar('0')));
+            option_content.append(QString("%1 ").arg((uint)data.data[i], 2, 16, QChar('0')));
 
             if (i && ((i & 15) == 15))
             {
@@ -240,66 +346,223 @@ QList<QString> DHCPPacket::PacketDetailDump() const
 
 PXEResponder::PXEResponder(const QString &bootFile, QObject *parent)
     : QObject(parent)
+    , listener(nullptr)
+    , bootServer(false)
+    , bootListener(nullptr)
     , bootFileUtf8(bootFile.toUtf8())
+    , httpPort(0)
+    , httpBoot(false)
+    , verbose(false)
+    , requests(32, 1500)
+    , replies(maxReplies)
+    , bootReplies(maxReplies)
+    , replyBatch(&replies)
+    , replySlotSize(0)
+    , slotsUsed(0)
 {
 }
 
-void PXEResponder::init()
+void PXEResponder::SetHttpBoot(quint16 port, const QString &bootFile)
 {
-    // Get network interface list
-    QList<QHostAddress> addresses = QNetworkInterface::allAddresses();
+    httpPort = port;
+    httpBootFileUtf8 = bootFile.toUtf8();
 
-    emit verboseEvent(QString("Total interfaces: %1").arg(addresses.size()));
+    // Both name a file under the root, with or without the slash
+    QString tftpFile = QString::fromUtf8(bootFileUtf8);
+    QString httpFile = bootFile;
+    while (tftpFile.startsWith('/'))
+        tftpFile.remove(0, 1);
+    while (httpFile.startsWith('/'))
+        httpFile.remove(0, 1);
 
-    for (int i = 0; i < addresses.size(); ++i)
-    {
-        // Only support IPv4
-        if (addresses[i].protocol() != QUdpSocket::IPv4Protocol)
-            continue;
+    httpBoot = port && !httpFile.isEmpty() && httpFile != tftpFile;
 
-        // Don't other looking at the loopback interface
-        if (addresses[i] == QHostAddress(QHostAddress::LocalHost))
-            continue;
+    for (InterfaceList::iterator i = interfaces.begin(),
+         e = interfaces.end(); i != e; ++i)
+        BuildTemplates(*i);
+}
+
+PXEResponder::Profile PXEResponder::ProfileFor(const DHCPPacket *dhcp) const
+{
+    bool httpClass = dhcp->IsHttpClient();
+
+    // The PXE ROM itself only speaks TFTP
+    bool httpUrl = httpBoot && (httpClass || dhcp->IsIpxe());
+
+    if (httpClass)
+        return httpUrl ? HTTPCLIENT_HTTP : HTTPCLIENT_TFTP;
+
+    return httpUrl ? PXE_HTTP : PXE_TFTP;
+}
+
+QByteArray PXEResponder::BootFileFor(const Interface &interface,
+                                     Profile profile) const
+{
+    if (profile != PXE_HTTP && profile != HTTPCLIENT_HTTP)
+        return bootFileUtf8;
+
+    QByteArray url = QString("http://%1:%2/")
+            .arg(interface.addrString).arg(httpPort).toUtf8();
+    url.append(httpBootFileUtf8);
 
-        interfaces.append(Interface());
-        Interface& interface = interfaces.back();
+    return url;
+}
 
-        interface.addr = addresses[i];
-        interface.addrString = addresses[i].toString();
+void PXEResponder::SetInterfaces(const QStringList &names)
+{
+    allowedInterfaces = names;
+}
 
-        emit verboseEvent(QString("Added interface %1").arg(interface.addrString));
+void PXEResponder::SetBootServer(bool enable)
+{
+    bootServer = enable;
+}
 
-        // Create a UDP socket and bind it to port 67
-        interface.listener = new QUdpSocket(this);
+void PXEResponder::SetVerbose(bool enable)
+{
+    verbose = enable;
+}
+
+void PXEResponder::init()
+{
+    if (httpPort && !httpBoot)
+    {
+        if (httpBootFileUtf8.isEmpty())
+            emit verboseEvent("No HTTP boot file, HTTP boot URLs are off");
+        else
+            emit warningEvent("The HTTP boot file is the TFTP boot file,"
+                              " HTTP boot URLs are off");
+    }
 
-        // We don't bind to an address because we want to receive broadcasts
-        if (!interface.listener->bind(67, QUdpSocket::ShareAddress))
-//        if (!interface.listener->bind(4011))
+    // Bind the boot server before the templates are built, they only
+    // send clients to port 4011 if something is listening there
+    if (bootServer)
+    {
+        bootListener = new QUdpSocket(this);
+
+        if (bootListener->bind(QHostAddress::AnyIPv4, 4011))
         {
-            emit errorEvent("Failed to bind DHCP listener, giving up");
+            UdpRecvBatch::EnablePacketInfo(bootListener);
         }
         else
         {
-            // Connect the readyRead signal to our slot
-            connect(interface.listener, SIGNAL(readyRead()), this, SLOT(on_packet()));
-            emit verboseEvent("Listening for DHCP requests");
+            emit warningEvent("Failed to bind PXE boot server listener,"
+                              " answering on port 67 only");
+            delete bootListener;
+            bootListener = nullptr;
+            bootServer = false;
         }
+    }
+
+    QList<QNetworkInterface> all = QNetworkInterface::allInterfaces();
+
+    emit verboseEvent(QString("Total interfaces: %1").arg(all.size()));
+
+    for (int i = 0; i < all.size(); ++i)
+    {
+        const QNetworkInterface &iface = all[i];
+
+        // Don't bother looking at the loopback interface
+        if ((iface.flags() & QNetworkInterface::IsLoopBack) ||
+                !(iface.flags() & QNetworkInterface::IsUp))
+            continue;
+
+        QList<QNetworkAddressEntry> entries = iface.addressEntries();
+
+        for (int n = 0; n < entries.size(); ++n)
+        {
+            QHostAddress addr = entries[n].ip();
 
+            // Only support IPv4
+            if (addr.protocol() != QUdpSocket::IPv4Protocol)
+                continue;
+
+            if (!allowedInterfaces.isEmpty() &&
+                    !allowedInterfaces.contains(iface.name()) &&
+                    !allowedInterfaces.contains(addr.toString()))
+                continue;
+
+            interfaces.append(Interface());
+            Interface& interface = interfaces.back();
+
+            interface.addr = addr;
+            interface.addrString = addr.toString();
+            interface.index = iface.index();
+
+            emit verboseEvent(QString("Added interface %1 (%2)")
+                              .arg(interface.addrString)
+                              .arg(iface.name()));
+
+            BuildTemplates(interface);
+        }
+    }
+
+    if (interfaces.isEmpty())
+    {
+        emit errorEvent("Could not find suitable network interface");
         return;
     }
 
-    emit errorEvent("Could not find suitable network interface");
+    // Create a UDP socket and bind it to port 67
+    listener = new QUdpSocket(this);
+
+    // We don't bind to an address because we want to receive broadcasts,
+    // the interface each one came in on is told by IP_PKTINFO
+    if (!listener->bind(QHostAddress::AnyIPv4, 67, QUdpSocket::ShareAddress))
+    {
+        emit errorEvent("Failed to bind DHCP listener, giving up");
+        return;
+    }
+
+    if (!UdpRecvBatch::EnablePacketInfo(listener) && interfaces.size() > 1)
+        emit warningEvent("No IP_PKTINFO, replying from the first interface");
+
+    // Connect the readyRead signal to our slot
+    connect(listener, SIGNAL(readyRead()), this, SLOT(on_packet()));
+    emit verboseEvent("Listening for DHCP requests");
+
+    if (bootListener)
+    {
+        connect(bootListener, SIGNAL(readyRead()),
+                this, SLOT(on_boot_packet()));
+        emit verboseEvent("Listening for PXE boot server requests");
+    }
 }
 
-void PXEResponder::sendDhcpOffer(DHCPPacket *dhcp, Interface& interface)
-{    
+PXEResponder::Interface *PXEResponder::IngressInterface(
+        int ifindex, const QHostAddress &local)
+{
+    // Without packet info all we can do is guess
+    if (!ifindex)
+        return &interfaces.front();
+
+    // Prefer the address the kernel would reply from, an interface
+    // can have several
+    Interface *match = nullptr;
+    for (InterfaceList::iterator i = interfaces.begin(),
+         e = interfaces.end(); i != e; ++i)
+    {
+        if (i->index != ifindex)
+            continue;
+
+        if (i->addr == local)
+            return &*i;
+
+        if (!match)
+            match = &*i;
+    }
+
+    return match;
+}
+
+QByteArray PXEResponder::BuildOffer(const Interface &interface, Profile profile)
+{
     DHCPPacketHeader offer;
     memset(&offer, 0, sizeof(offer));
     offer.op = 2;
     offer.htype = 1;
     offer.hlen = 6;
     offer.hops = 0;
-    offer.xid = dhcp->TransactionId();
 
     // Proxy DHCP must set IP to 0.0.0.0
     offer.ciaddr = 0;
@@ -307,9 +570,6 @@ void PXEResponder::sendDhcpOffer(DHCPPacket *dhcp, Interface& interface)
     // Next-server address
     offer.siaddr = qToBigEndian(interface.addr.toIPv4Address());
 
-    // Copy client hardware address
-    dhcp->CopyHardwareAddrTo(offer);
-
     // Build options
     QByteArray offer_options;
 
@@ -343,26 +603,44 @@ void PXEResponder::sendDhcpOffer(DHCPPacket *dhcp, Interface& interface)
     //offer_options.append(client_id.size());
     //offer_options.append((const char *)client_id.data(), client_id.size());
 
-    // Option #60
-    offer_options.append(60);
-    offer_options.append(9);
-    offer_options.append("PXEClient", 9);
+    // Option #60, echo the client's class
+    if (profile == HTTPCLIENT_TFTP || profile == HTTPCLIENT_HTTP)
+    {
+        offer_options.append(60);
+        offer_options.append(10);
+        offer_options.append("HTTPClient", 10);
+    }
+    else
+    {
+        offer_options.append(60);
+        offer_options.append(9);
+        offer_options.append("PXEClient", 9);
+    }
 
     // Option #67, boot file
+    QByteArray bootFile = BootFileFor(interface, profile);
     offer_options.append(67);
-    offer_options.append(bootFileUtf8.size());
-    offer_options.append(bootFileUtf8);
+    offer_options.append(bootFile.size());
+    offer_options.append(bootFile);
 
     // Vendor options option
     QByteArray vendor_options;
 
+    // PXE clients discover the boot server on port 4011 when it is
+    // enabled, HTTP boot has no discovery
+    bool discover = bootServer && profile == PXE_TFTP;
+
     // Option #6, PXE_DISCOVERY_CONTROL
     vendor_options.append(6);
     vendor_options.append(1);
     // bit 3: just use boot filename, no prompt/menu/discover
     // bit 2: only use/accept servers in PXE_BOOT_SERVERS
     // bit 1: disable multicast discovery
-    vendor_options.append((1 << 3) | /*(1 << 2) |*/ (1 << 1));
+    // bit 0: disable broadcast discovery
+    if (discover)
+        vendor_options.append((1 << 2) | (1 << 1) | (1 << 0));
+    else
+        vendor_options.append((1 << 3) | /*(1 << 2) |*/ (1 << 1));
     //vendor_options.append(7);  // use boot server list, broadcast discovery
 
     // Vendor option #8, server list
@@ -376,6 +654,24 @@ void PXEResponder::sendDhcpOffer(DHCPPacket *dhcp, Interface& interface)
     vendor_options.append((selfaddr >>  8) & 0xFF);
     vendor_options.append((selfaddr      ) & 0xFF);
 
+    if (discover)
+    {
+        // Vendor option #9, boot menu, one entry of our server type
+        vendor_options.append(9);
+        vendor_options.append(3 + 7);
+        vendor_options.append((char)0x80);  // type (hi)
+        vendor_options.append((char)0);     // type (lo)
+        vendor_options.append(7);
+        vendor_options.append("PXEDHCP", 7);
+
+        // Vendor option #10, menu prompt, timeout 0 takes the first
+        // entry without showing anything
+        vendor_options.append(10);
+        vendor_options.append(1 + 7);
+        vendor_options.append((char)0);
+        vendor_options.append("PXEDHCP", 7);
+    }
+
     vendor_options.append((char)255);
 
     offer_options.append(43);
@@ -384,28 +680,28 @@ void PXEResponder::sendDhcpOffer(DHCPPacket *dhcp, Interface& interface)
 
     offer_options.append((char)255);
 
-    //offer_options.append();
+    return offer_options;
+}
 
+void PXEResponder::sendDhcpOffer(DHCPPacket *dhcp, Interface& interface)
+{
     // Source address is probably 0.0.0.0,
     // because the client hasn't had an address assigned yet!
     auto targetAddress = dhcp->GetSourceAddress();
     if (targetAddress.toIPv4Address() == 0)
         targetAddress = QHostAddress::Broadcast;
 
-    auto bytesSent = interface.listener->writeDatagram(
-                offer_options, targetAddress, 68);
-    if (bytesSent < 0)
-        emit verboseEvent(
-                QString("Sent DHCPOFFER (%1 bytes, error=%2)")
-                .arg(bytesSent)
-                .arg(interface.listener->errorString()));
-    else
-        emit verboseEvent(
-                QString("Sent DHCPOFFER (%1 bytes)")
-                .arg(bytesSent));
+    const QByteArray &offer = interface.offerTemplates[ProfileFor(dhcp)];
+
+    // Sent with the rest of the batch once the socket is drained
+    QueueReply(offer, dhcp, interface, targetAddress, 68);
+
+    if (verbose)
+        emit verboseEvent(QString("Queued DHCPOFFER (%1 bytes)")
+                          .arg(offer.size()));
 }
 
-void PXEResponder::sendDhcpAck(DHCPPacket *dhcp, Interface& interface)
+QByteArray PXEResponder::BuildAck(const Interface &interface, Profile profile)
 {
     DHCPPacketHeader offer;
     memset(&offer, 0, sizeof(offer));
@@ -413,7 +709,6 @@ void PXEResponder::sendDhcpAck(DHCPPacket *dhcp, Interface& interface)
     offer.htype = 1;
     offer.hlen = 6;
     offer.hops = 0;
-    offer.xid = dhcp->TransactionId();
 
     // Proxy DHCP must set IP to 0.0.0.0
     offer.ciaddr = 0;
@@ -421,9 +716,6 @@ void PXEResponder::sendDhcpAck(DHCPPacket *dhcp, Interface& interface)
     // Next-server address
     offer.siaddr = qToBigEndian(interface.addr.toIPv4Address());
 
-    // Copy client hardware address
-    dhcp->CopyHardwareAddrTo(offer);
-    
     QByteArray str;
 
     str = interface.addrString.toUtf8();
@@ -434,10 +726,12 @@ void PXEResponder::sendDhcpAck(DHCPPacket *dhcp, Interface& interface)
                 offer.sname);
     str.clear();
 
+    QByteArray bootFile = BootFileFor(interface, profile);
+
     std::fill(std::begin(offer.file), std::end(offer.file), 0);
-    std::copy_n(bootFileUtf8.begin(),
+    std::copy_n(bootFile.constBegin(),
                 std::min(sizeof(offer.file)-1,
-                         size_t(bootFileUtf8.size())),
+                         size_t(bootFile.size())),
                 offer.file);
 
     // Build options
@@ -450,10 +744,19 @@ void PXEResponder::sendDhcpAck(DHCPPacket *dhcp, Interface& interface)
     offer_options.append(1);
     offer_options.append(5);        // 5=DHCPACK
 
-    // Option #60
-    offer_options.append(60);
-    offer_options.append(9);
-    offer_options.append("PXEClient", 9);
+    // Option #60, echo the client's class
+    if (profile == HTTPCLIENT_TFTP || profile == HTTPCLIENT_HTTP)
+    {
+        offer_options.append(60);
+        offer_options.append(10);
+        offer_options.append("HTTPClient", 10);
+    }
+    else
+    {
+        offer_options.append(60);
+        offer_options.append(9);
+        offer_options.append("PXEClient", 9);
+    }
 
     // Need:
     // boot server list
@@ -493,8 +796,8 @@ void PXEResponder::sendDhcpAck(DHCPPacket *dhcp, Interface& interface)
 
     // Option #67, boot file
     offer_options.append(67);
-    offer_options.append(bootFileUtf8.size());
-    offer_options.append(bootFileUtf8);
+    offer_options.append(bootFile.size());
+    offer_options.append(bootFile);
 
     // Vendor options option
     QByteArray vendor_options;
@@ -507,6 +810,18 @@ void PXEResponder::sendDhcpAck(DHCPPacket *dhcp, Interface& interface)
     vendor_options.append((1 << 3) | (0 << 2) | (1 << 1));
     //vendor_options.append(7);  // use boot server list, broadcast discovery
 
+    if (bootServer && profile == PXE_TFTP)
+    {
+        // Vendor option #71, boot item, the client checks it matches
+        // what it asked the boot server for
+        vendor_options.append(71);
+        vendor_options.append(4);
+        vendor_options.append((char)0x80);  // type (hi)
+        vendor_options.append((char)0);     // type (lo)
+        vendor_options.append((char)0);     // layer (hi)
+        vendor_options.append((char)0);     // layer (lo)
+    }
+
     vendor_options.append((char)255);
 
     // Option #43, vendor options
@@ -516,57 +831,143 @@ void PXEResponder::sendDhcpAck(DHCPPacket *dhcp, Interface& interface)
 
     offer_options.append((char)255);
     
-    auto bytesSent = interface.listener->writeDatagram(
-                offer_options, dhcp->GetSourceAddress(), 68);
-
-    if (bytesSent < 0)
-        emit verboseEvent(QString("Sent DHCPACK"
-                                  " (%1 bytes, error=%2)")
-                          .arg(bytesSent)
-                          .arg(interface.listener->errorString()));
-    else
-        emit verboseEvent(QString("Sent DHCPACK (%1 bytes)")
-                          .arg(bytesSent));
+    return offer_options;
+}
+
+void PXEResponder::sendDhcpAck(DHCPPacket *dhcp, Interface& interface)
+{
+    const QByteArray &ack = interface.ackTemplates[ProfileFor(dhcp)];
+
+    // To the port it came from, 68 through the DHCP port, whatever
+    // the client picked when it asked the boot server on 4011
+    QueueReply(ack, dhcp, interface, dhcp->GetSourceAddress(),
+               dhcp->GetSourcePort());
+
+    if (verbose)
+        emit verboseEvent(QString("Queued DHCPACK (%1 bytes)")
+                          .arg(ack.size()));
+}
+
+void PXEResponder::BuildTemplates(Interface &interface)
+{
+    for (int i = 0; i < PROFILE_COUNT; ++i)
+    {
+        Profile profile = Profile(i);
+
+        interface.offerTemplates[i] = BuildOffer(interface, profile);
+        interface.ackTemplates[i] = BuildAck(interface, profile);
+
+        replySlotSize = qMax(replySlotSize,
+                             interface.offerTemplates[i].size());
+        replySlotSize = qMax(replySlotSize,
+                             interface.ackTemplates[i].size());
+    }
+
+    // Only grows, and only between batches
+    if (replyBuffer.size() < maxReplies * replySlotSize)
+        replyBuffer.resize(maxReplies * replySlotSize);
+}
+
+void PXEResponder::QueueReply(const QByteArray &reply,
+                              const DHCPPacket *dhcp,
+                              const Interface &interface,
+                              const QHostAddress &target,
+                              quint16 port)
+{
+    // A slot stays in use until the batch goes out
+    if (slotsUsed == maxReplies)
+    {
+        replyBatch->Flush();
+        slotsUsed = 0;
+    }
+
+    char *slot = replyBuffer.data() + slotsUsed++ * replySlotSize;
+    memcpy(slot, reply.constData(), reply.size());
+
+    DHCPPacketHeader *header = (DHCPPacketHeader *)slot;
+    header->xid = dhcp->TransactionId();
+    header->flags = dhcp->Flags();
+    dhcp->CopyHardwareAddrTo(*header);
+
+    // Broadcasts from the wildcard socket would otherwise all leave
+    // through the default route's interface
+    replyBatch->SetSource(interface.index, interface.addr);
+    replyBatch->Queue(target, port, nullptr, 0, slot, reply.size());
 }
 
 void PXEResponder::on_packet()
 {
-    DHCPPacket *dhcp = new DHCPPacket(this);
+    on_packet(listener);
+}
 
-    for (InterfaceList::iterator i = interfaces.begin(), 
-         e = interfaces.end(); i != e; ++i)
+void PXEResponder::on_boot_packet()
+{
+    on_packet(bootListener);
+}
+
+void PXEResponder::on_packet(QUdpSocket *socket)
+{
+    DHCPPacket *dhcp = &request;
+
+    replyBatch = (socket == bootListener) ? &bootReplies : &replies;
+    replyBatch->SetSocket(socket);
+
+    int count;
+    while ((count = requests.Receive(socket)) > 0)
     {
-        Interface& interface = *i;
-        while (interface.listener->hasPendingDatagrams())
+        for (int n = 0; n < count; ++n)
         {
-            if (!dhcp->Read(interface.listener))
+            if (requests.Size(n) < 0 ||
+                    !dhcp->Parse(requests.Data(n), requests.Size(n),
+                                 requests.Address(n), requests.Port(n)))
             {
                 emit errorEvent("Error decoding DHCP packet");
                 continue;
             }
 
-            // Ignore requests that are not from a PXE client
-            if (!dhcp->IsPxeRequest())
+            // Ignore requests that are not from a PXE or HTTP
+            // boot client
+            if (!dhcp->IsPxeRequest() && !dhcp->IsHttpClient())
+            {
+                if (verbose)
+                    emit verboseEvent("Ignoring non PXE packet");
+                continue;
+            }
+
+            Interface *ingress = IngressInterface(requests.InterfaceIndex(n),
+                                                  requests.LocalAddress(n));
+            if (!ingress)
             {
-                emit verboseEvent("Ignoring non PXE packet");
+                if (verbose)
+                    emit verboseEvent("Ignoring packet from unserved"
+                                      " interface");
                 continue;
             }
 
-            emit verboseEvent(QString("From %1")
-                              .arg(dhcp->GetSourceAddress().toString()));
+            Interface &interface = *ingress;
 
-            QList<QString> detail = dhcp->PacketDetailDump();
-            for (QList<QString>::Iterator i = detail.begin(); 
-                 i != detail.end(); ++i) {
-                emit verboseEvent(*i);
+            if (verbose)
+            {
+                emit verboseEvent(QString("From %1 on %2")
+                                  .arg(dhcp->GetSourceAddress().toString())
+                                  .arg(interface.addrString));
+
+                QList<QString> detail = dhcp->PacketDetailDump();
+                for (QList<QString>::Iterator i = detail.begin();
+                     i != detail.end(); ++i) {
+                    emit verboseEvent(*i);
+                }
             }
-            
+
             //emit verboseEvent(QString("Message type is %1")
             //                  .arg(dhcp->GetMessageType()));
 
-            if (dhcp->IsDhcpDiscover())
+            // The boot server only answers requests, discovery
+            // belongs to the DHCP port
+            if (dhcp->IsDhcpDiscover() && socket != bootListener)
             {
-                emit verboseEvent("Got discover");
+                if (verbose)
+                    emit verboseEvent("Got discover");
 
                 // Send DHCPOFFER response
                 sendDhcpOffer(dhcp, interface);
@@ -574,15 +975,24 @@ void PXEResponder::on_packet()
             else if (dhcp->IsDhcpRequest())
             {
                 // Send DHCPACK
-                emit verboseEvent("Got request!");
-                
+                if (verbose)
+                    emit verboseEvent("Got request!");
+
                 sendDhcpAck(dhcp, interface);
 
             }
-            else
+            else if (verbose)
             {
                 emit verboseEvent("Got something else?");
             }
         }
     }
+
+    // One sendmmsg for everything answered in this pass
+    int queued = replyBatch->Pending();
+    int sent = replyBatch->Flush();
+    slotsUsed = 0;
+    if (sent != queued)
+        emit errorEvent(QString("Failed to send %1 DHCP replies")
+                        .arg(queued - sent));
 }
@@ -21,48 +21,7 @@
 #include <QSignalMapper>
 #include <QtNetwork/QNetworkInterface>
 
-class DHCPPacket;
-
-class PXEResponder : public QObject
-{
-    Q_OBJECT
-    
-    class Interface;
-
-public:
-    PXEResponder(const QString &bootFile, QObject *parent = 0);
-    void init();
-
-public slots:
-    void on_packet();
-
-public:
-    void on_packet(QUdpSocket*);
-
-signals:
-    void verboseEvent(const QString &);
-    void errorEvent(const QString &);
-    void warningEvent(const QString &);
-
-private:
-    void sendDhcpOffer(DHCPPacket *dhcp, Interface &interface);
-    void sendDhcpAck(DHCPPacket *dhcp, Interface& interface);
-    
-    struct Interface
-    {
-        QHostAddress addr;
-        QString addrString;
-        QUdpSocket *listener;
-
-        Interface() : listener(0) {}
-        ~Interface() { delete listener; }
-    };
-
-    typedef QList<Interface> InterfaceList;
-    InterfaceList interfaces;
-    
-    QByteArray bootFileUtf8;
-};
+#include "udpbatch.h"
 
 struct DHCPPacketHeader
 {
@@ -90,52 +49,206 @@ struct DHCPPacketHeader
     bool IsValid() const;
 };
 
-class DHCPPacket : public QObject
+// Decoder for one request at a time, reused for every datagram
+class DHCPPacket
 {
-    Q_OBJECT
-
-    QVector<quint8> buffer;
-
-    DHCPPacketHeader header;
-
 public:
-    typedef QVector<quint8> OptionData;
+    // Points into the datagram, valid until the next Parse
+    struct OptionData
+    {
+        const quint8 *data;
+        int size;
+    };
 
 private:
-    typedef QMap<quint8,OptionData> OptionMap;
-
-    OptionMap ParseOptions(quint8 *options, quint32 options_len);
+    // The datagram being decoded, not copied. Read fills readBuffer
+    // and decodes from there
+    const quint8 *packet;
+    int packetSize;
+    const DHCPPacketHeader *header;
+    QByteArray readBuffer;
+
+    Q_DISABLE_COPY(DHCPPacket)
+
+    // Offset and length of every option present, built on first use.
+    // The class identifier is looked up without it, so packets from
+    // other clients are turned away before the options are indexed
+    mutable bool indexed;
+    mutable quint32 present[256 / 32];
+    mutable quint16 optionOffset[256];
+    mutable quint8 optionLength[256];
+
+    void BuildIndex() const;
+    bool FindOption(quint8 option_id, OptionData *result) const;
     QString LookupOptionName(quint8 id) const;
 
     QHostAddress sourceAddress;
     quint16 sourcePort;
 
-    OptionMap options;
-
     quint8 GetMessageType() const;
     bool IsMessageType(quint8 type) const;
 
 public:
-    DHCPPacket(QObject *parent) : QObject(parent) {}
-    ~DHCPPacket() {}
+    DHCPPacket();
 
     quint32 TransactionId() const;
+    quint16 Flags() const;
     void CopyHardwareAddrTo(DHCPPacketHeader &dest) const;
 
     bool Read(QUdpSocket *socket);
 
+    // Decodes in place, data must stay valid and unchanged while the
+    // packet is used, and be 4 byte aligned
+    bool Parse(const char *data, int size,
+               const QHostAddress &addr, quint16 port);
+
     QHostAddress GetSourceAddress() const;
     quint16 GetSourcePort() const;
 
     bool IsPxeRequest() const;
 
+    // UEFI HTTP boot, class identifier "HTTPClient"
+    bool IsHttpClient() const;
+
+    // iPXE, user class "iPXE" or its encapsulated options
+    bool IsIpxe() const;
+
     bool IsDhcpDiscover() const;
     bool IsDhcpRequest() const;
 
     bool OptionExists(quint8 option_id) const;
-    const OptionData &OptionContent(quint8 option_id) const;
+    OptionData OptionContent(quint8 option_id) const;
 
     QList<QString> PacketDetailDump() const;
 };
 
+class PXEResponder : public QObject
+{
+    Q_OBJECT
+    
+    class Interface;
+
+public:
+    PXEResponder(const QString &bootFile, QObject *parent = 0);
+    void init();
+
+    // Hand iPXE and UEFI HTTP clients an http:// URL for bootFile
+    // instead of the TFTP boot file. Port 0 or an empty bootFile
+    // disables it. So does a bootFile that is the TFTP boot file, the
+    // one that usually chainloads iPXE, or iPXE would load itself
+    // over and over
+    void SetHttpBoot(quint16 port, const QString &bootFile);
+
+    // Serve only these interfaces, by name or address. Empty serves
+    // every IPv4 interface. Call before init
+    void SetInterfaces(const QStringList &names);
+
+    // Answer PXE boot server requests on port 4011, and have PXE
+    // clients' discovery unicast there instead of taking the boot
+    // file from the proxy offer. Call before init
+    void SetBootServer(bool enable);
+
+    // Log every request in detail. Off, a request costs no formatting
+    void SetVerbose(bool enable);
+
+public slots:
+    void on_packet();
+    void on_boot_packet();
+
+public:
+    void on_packet(QUdpSocket*);
+
+signals:
+    void verboseEvent(const QString &);
+    void errorEvent(const QString &);
+    void warningEvent(const QString &);
+
+private:
+    void sendDhcpOffer(DHCPPacket *dhcp, Interface &interface);
+    void sendDhcpAck(DHCPPacket *dhcp, Interface& interface);
+
+    // Replies differ by the class the client gave in option 60 and by
+    // whether it is handed the TFTP boot file or an http:// URL
+    enum Profile
+    {
+        PXE_TFTP,
+        PXE_HTTP,
+        HTTPCLIENT_TFTP,
+        HTTPCLIENT_HTTP,
+        PROFILE_COUNT
+    };
+
+    Profile ProfileFor(const DHCPPacket *dhcp) const;
+
+    // Replies are built once per interface and profile, everything
+    // but xid, flags and chaddr. Rebuilt when the boot setup changes
+    void BuildTemplates(Interface &interface);
+    QByteArray BuildOffer(const Interface &interface, Profile profile);
+    QByteArray BuildAck(const Interface &interface, Profile profile);
+    QByteArray BootFileFor(const Interface &interface, Profile profile) const;
+
+    // Copies a template into the next free reply slot, fills in the
+    // client's fields and queues it to leave through interface
+    void QueueReply(const QByteArray &reply, const DHCPPacket *dhcp,
+                    const Interface &interface, const QHostAddress &target,
+                    quint16 port);
+
+    // One per served IPv4 address
+    struct Interface
+    {
+        QHostAddress addr;
+        QString addrString;
+
+        // OS interface index, matched against IP_PKTINFO
+        int index;
+
+        QByteArray offerTemplates[PROFILE_COUNT];
+        QByteArray ackTemplates[PROFILE_COUNT];
+
+        Interface() : index(0) {}
+    };
+
+    typedef QList<Interface> InterfaceList;
+    InterfaceList interfaces;
+    QStringList allowedInterfaces;
+
+    // The interface a request came in on, null if it isn't served
+    Interface *IngressInterface(int ifindex, const QHostAddress &local);
+
+    // Wildcard socket on port 67, requests from every interface
+    QUdpSocket *listener;
+
+    // Unicast boot server requests on port 4011, only PXE clients
+    // that were pointed here send to it
+    bool bootServer;
+    QUdpSocket *bootListener;
+    
+    QByteArray bootFileUtf8;
+
+    quint16 httpPort;
+    QByteArray httpBootFileUtf8;
+    bool httpBoot;
+
+    bool verbose;
+
+    UdpRecvBatch requests;
+
+    // One per socket, a batch may keep replies until its socket
+    // drains. replyBatch is the one for the socket being served
+    UdpSendBatch replies;
+    UdpSendBatch bootReplies;
+    UdpSendBatch *replyBatch;
+
+    // Decodes each request in turn
+    DHCPPacket request;
+
+    // One slot per queued reply, the batch points into them until it
+    // is flushed. Slots fit the largest template. Replies a flush has
+    // to keep are copied, so every slot is free again after one
+    static const int maxReplies = 32;
+    QByteArray replyBuffer;
+    int replySlotSize;
+    int slotsUsed;
+};
+
 #endif // PXERESPONDER_H
@@ -21,6 +21,8 @@
 PXEService::PXEService(const QString &serverRoot, const QString &bootFile,
                        QObject *parent)
     : QObject(parent)
+    , httpServer(nullptr)
+    , httpPort(0)
 {
     responder = new PXEResponder(bootFile, this);
     connect(responder, SIGNAL(verboseEvent(QString)),
@@ -43,6 +45,40 @@ void PXEService::init()
 {
     responder->init();
     tftpServer->init();
+
+    if (httpPort)
+    {
+        // Same files, through the TFTP server's path index
+        httpServer = new HTTPServer(tftpServer->Index(), httpPort, this);
+        connect(httpServer, SIGNAL(verboseEvent(QString)),
+                this, SLOT(on_dhcp_message(QString)));
+        connect(httpServer, SIGNAL(errorEvent(QString)),
+                this, SLOT(on_dhcp_message(QString)));
+        httpServer->SetInterfaces(interfaces);
+        httpServer->init();
+    }
+}
+
+void PXEService::SetHttpBoot(quint16 port, const QString &bootFile)
+{
+    httpPort = port;
+    responder->SetHttpBoot(port, bootFile);
+}
+
+void PXEService::SetInterfaces(const QStringList &names)
+{
+    interfaces = names;
+    responder->SetInterfaces(names);
+}
+
+TFTPServer *PXEService::tftp() const
+{
+    return tftpServer;
+}
+
+PXEResponder *PXEService::dhcp() const
+{
+    return responder;
 }
 
 void PXEService::on_dhcp_message(const QString &msg) const
@@ -19,6 +19,7 @@
 #include <QObject>
 #include "pxeresponder.h"
 #include "tftpserver.h"
+#include "httpserver.h"
 
 class PXEService : public QObject
 {
@@ -27,10 +28,27 @@ class PXEService : public QObject
     PXEResponder *responder;
     TFTPServer *tftpServer;
 
+    // Created by init when an HTTP port is set
+    HTTPServer *httpServer;
+    quint16 httpPort;
+
+    QStringList interfaces;
+
 public:
     PXEService(const QString &serverRoot, const QString &bootFile,
                QObject *parent = 0);
     void init();
+
+    TFTPServer *tftp() const;
+    PXEResponder *dhcp() const;
+
+    // Serve serverRoot over HTTP too, and hand HTTP capable clients
+    // a URL for bootFile. Call before init
+    void SetHttpBoot(quint16 port, const QString &bootFile);
+
+    // Serve DHCP and HTTP only on these interfaces, by name or
+    // address. Empty serves all of them. Call before init
+    void SetInterfaces(const QStringList &names);
     
 signals:
     void message(const QString &message) const;
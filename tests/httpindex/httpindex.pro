@@ -0,0 +1,16 @@
+CONFIG += console
+CONFIG += testcase
+CONFIG += warn_on
+CONFIG += c++11
+QMAKE_CXXFLAGS += -std=c++11
+CONFIG -= app_bundle
+
+TARGET = tst_httpindex
+
+QT += network testlib
+QT -= gui
+
+include(../../tftp.pri)
+
+SOURCES += tst_httpindex.cpp ../../httpserver.cpp
+HEADERS += ../../httpserver.h
@@ -0,0 +1,85 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+// The HTTP server resolves files through the TFTP server's path
+// index. It must still serve them when the TFTP port can't be bound,
+// as port 69 can't without privileges
+
+#include <QtTest>
+#include <QUdpSocket>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+#include <QFile>
+
+#include "tftpserver.h"
+#include "httpserver.h"
+
+class TestHTTPIndex : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void tftpPortTaken();
+};
+
+void TestHTTPIndex::tftpPortTaken()
+{
+    QTemporaryDir root;
+    QVERIFY(root.isValid());
+
+    QFile file(root.path() + "/boot.ipxe");
+    QVERIFY(file.open(QFile::WriteOnly));
+    file.write("#!ipxe\n");
+    file.close();
+
+    // Only world readable files are served
+    QVERIFY(file.setPermissions(file.permissions() | QFile::ReadOther));
+
+    // Someone else has the TFTP port, and doesn't share it
+    QUdpSocket taken;
+    QVERIFY(taken.bind(QHostAddress::Any, 0, QUdpSocket::DontShareAddress));
+
+    TFTPServer tftp(root.path());
+    tftp.SetPort(taken.localPort());
+    tftp.SetWorkerCount(0);
+    tftp.init();
+
+    QVERIFY(tftp.Index() != nullptr);
+
+    // Started the way PXEService does
+    HTTPServer http(tftp.Index(), 0);
+    QVERIFY(http.init());
+    QVERIFY(http.Port() != 0);
+
+    QTcpSocket client;
+    client.connectToHost(QHostAddress::LocalHost, http.Port());
+    QTRY_COMPARE(client.state(), QAbstractSocket::ConnectedState);
+
+    client.write("GET /boot.ipxe HTTP/1.1\r\n"
+                 "Host: localhost\r\n"
+                 "Connection: close\r\n"
+                 "\r\n");
+
+    // Closed once the body is out, what was sent can still be read
+    QTRY_COMPARE(client.state(), QAbstractSocket::UnconnectedState);
+
+    QByteArray response = client.readAll();
+    QVERIFY(response.startsWith("HTTP/1.1 200 OK\r\n"));
+    QVERIFY(response.endsWith("\r\n\r\n#!ipxe\n"));
+}
+
+QTEST_MAIN(TestHTTPIndex)
+
+#include "tst_httpindex.moc"
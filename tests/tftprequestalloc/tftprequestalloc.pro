@@ -0,0 +1,16 @@
+CONFIG += console
+CONFIG += testcase
+CONFIG += warn_on
+CONFIG += c++11
+QMAKE_CXXFLAGS += -std=c++11
+CONFIG -= app_bundle
+
+TARGET = tst_tftprequestalloc
+
+QT += testlib
+QT -= gui
+
+INCLUDEPATH += ../..
+
+SOURCES += tst_tftprequestalloc.cpp ../../tftprequest.cpp
+HEADERS += ../../tftprequest.h
@@ -0,0 +1,186 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+// TFTPRequest::Parse decodes in place. Every heap allocation made
+// while requests are parsed in a loop is counted, there must be none.
+// What was decoded is checked once, outside the loop
+
+#include <QtTest>
+#include <QAtomicInt>
+#include <new>
+#include <stdlib.h>
+
+#include "tftprequest.h"
+
+// Counts every operator new in the process. The test only reads the
+// difference across the parse loop
+static QAtomicInt allocations;
+
+void *operator new(size_t size)
+{
+    allocations.ref();
+
+    if (void *block = malloc(size ? size : 1))
+        return block;
+
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *block) noexcept
+{
+    free(block);
+}
+
+void operator delete[](void *block) noexcept
+{
+    free(block);
+}
+
+void operator delete(void *block, size_t) noexcept
+{
+    free(block);
+}
+
+void operator delete[](void *block, size_t) noexcept
+{
+    free(block);
+}
+
+// Options present in a request as name=value, in enum order
+static QStringList DecodedOptions(const TFTPRequest &request)
+{
+    static const char *const names[TFTPRequest::OPTIONCOUNT] =
+    {
+        "blksize", "tsize", "timeout", "windowsize", "multicast", "rollover"
+    };
+
+    QStringList decoded;
+
+    for (int option = 0; option < TFTPRequest::OPTIONCOUNT; ++option)
+    {
+        const char *value = request.Value((TFTPRequest::Option)option);
+        if (value)
+            decoded << QString("%1=%2").arg(names[option]).arg(value);
+    }
+
+    return decoded;
+}
+
+class TestTFTPRequestAlloc : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void parse_data();
+    void parse();
+};
+
+void TestTFTPRequestAlloc::parse_data()
+{
+    QTest::addColumn<QByteArray>("packet");
+    QTest::addColumn<bool>("valid");
+    QTest::addColumn<QString>("filename");
+    QTest::addColumn<QString>("mode");
+    QTest::addColumn<QStringList>("options");
+
+    QTest::newRow("plain")
+            << QByteArray("\0\1pxelinux.0\0octet\0", 19) << true
+            << "pxelinux.0" << "octet" << QStringList();
+
+    // Every option the server knows, mixed case as some ROMs send
+    QByteArray all("\0\1boot/grubx64.efi\0octet\0", 25);
+    all.append(QByteArray("BlkSize\0" "1468\0" "tsize\0" "0\0"
+                          "timeout\0" "2\0" "windowsize\0" "16\0"
+                          "multicast\0" "\0" "rollover\0" "0\0", 67));
+    QTest::newRow("all options") << all << true
+            << "boot/grubx64.efi" << "octet"
+            << (QStringList() << "blksize=1468" << "tsize=0" << "timeout=2"
+                << "windowsize=16" << "multicast=" << "rollover=0");
+
+    // Unknown options are skipped
+    QByteArray unknown("\0\1ipxe.efi\0octet\0", 17);
+    unknown.append(QByteArray("utimeout\0" "5000\0" "blksize\0" "512\0",
+                              26));
+    QTest::newRow("unknown option") << unknown << true
+            << "ipxe.efi" << "octet" << (QStringList() << "blksize=512");
+
+    // The first occurrence of an option wins, whatever its case
+    QByteArray repeated("\0\1pxelinux.0\0netascii\0", 22);
+    repeated.append(QByteArray("blksize\0" "1024\0" "BLKSIZE\0" "512\0",
+                               25));
+    QTest::newRow("repeated option") << repeated << true
+            << "pxelinux.0" << "netascii" << (QStringList() << "blksize=1024");
+
+    QTest::newRow("too small") << QByteArray("\0\1\0", 3) << false
+            << QString() << QString() << QStringList();
+    QTest::newRow("unterminated")
+            << QByteArray("\0\1pxelinux.0\0octet", 18) << false
+            << QString() << QString() << QStringList();
+    QTest::newRow("empty filename")
+            << QByteArray("\0\1\0octet\0", 9) << false
+            << QString() << QString() << QStringList();
+}
+
+void TestTFTPRequestAlloc::parse()
+{
+    QFETCH(QByteArray, packet);
+    QFETCH(bool, valid);
+    QFETCH(QString, filename);
+    QFETCH(QString, mode);
+    QFETCH(QStringList, options);
+
+    const char *data = packet.constData();
+    int size = packet.size();
+
+    // Anything lazily set up on first use isn't counted
+    TFTPRequest warmup;
+    QCOMPARE(warmup.Parse(data, size) == nullptr, valid);
+
+    if (valid)
+    {
+        QCOMPARE(QString(warmup.filename), filename);
+        QCOMPARE(QString(warmup.mode), mode);
+        QCOMPARE(DecodedOptions(warmup), options);
+    }
+
+    int before = allocations.load();
+
+    int accepted = 0;
+    for (int i = 0; i < 100000; ++i)
+    {
+        TFTPRequest request;
+        if (request.Parse(data, size))
+            continue;
+
+        ++accepted;
+
+        for (int option = 0; option < TFTPRequest::OPTIONCOUNT; ++option)
+            request.Value((TFTPRequest::Option)option);
+    }
+
+    int made = allocations.load() - before;
+
+    QCOMPARE(made, 0);
+    QCOMPARE(accepted, valid ? 100000 : 0);
+}
+
+QTEST_MAIN(TestTFTPRequestAlloc)
+
+#include "tst_tftprequestalloc.moc"
@@ -0,0 +1,15 @@
+CONFIG += console
+CONFIG += testcase
+CONFIG += warn_on
+CONFIG += c++11
+QMAKE_CXXFLAGS += -std=c++11
+CONFIG -= app_bundle
+
+TARGET = tst_tftprollover
+
+QT += network testlib
+QT -= gui
+
+include(../../tftp.pri)
+
+SOURCES += tst_tftprollover.cpp
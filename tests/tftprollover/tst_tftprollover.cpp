@@ -0,0 +1,392 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+// Transfers of sparse files far enough for the block number to wrap
+// past 65535 to either 0 or 1, one of them larger than 4GB
+
+#include <QtTest>
+#include <QUdpSocket>
+#include <QTemporaryDir>
+#include <QFile>
+#include <QThread>
+#include <QEventLoop>
+#include <QtEndian>
+
+#include "tftpserver.h"
+
+// Blocking TFTP client, on its own thread so the server can run on
+// the test's event loop
+class TFTPTestClient : public QThread
+{
+    Q_OBJECT
+
+    quint16 serverPort;
+    QString filename;
+    int blockSize;
+    int windowSize;
+    int rollover;
+
+    // Logical blocks acknowledged as soon as they arrive, even in the
+    // middle of a window, as a client that lost the rest would
+    QList<qint64> earlyAcks;
+
+    QUdpSocket *sock;
+    QHostAddress peerAddr;
+    quint16 peerPort;
+
+    void SendRequest();
+    void SendAck(quint16 block);
+    quint16 WireBlock(qint64 sequence) const;
+    bool ParseOack(const QByteArray &packet);
+
+protected:
+    void run();
+
+public:
+    TFTPTestClient(quint16 serverPort, const QString &filename,
+                   int blockSize, int windowSize, int rollover,
+                   const QList<qint64> &earlyAcks);
+
+    // Set by run
+    QString error;
+    qint64 received;
+    qint64 lastBlock;
+    int highestWire;
+    bool wrapped;
+};
+
+TFTPTestClient::TFTPTestClient(quint16 serverPort, const QString &filename,
+                               int blockSize, int windowSize, int rollover,
+                               const QList<qint64> &earlyAcks)
+    : serverPort(serverPort)
+    , filename(filename)
+    , blockSize(blockSize)
+    , windowSize(windowSize)
+    , rollover(rollover)
+    , earlyAcks(earlyAcks)
+    , sock(nullptr)
+    , peerPort(0)
+    , received(0)
+    , lastBlock(0)
+    , highestWire(0)
+    , wrapped(false)
+{
+}
+
+quint16 TFTPTestClient::WireBlock(qint64 sequence) const
+{
+    if (sequence <= 65535)
+        return (quint16)sequence;
+
+    return (quint16)(rollover + (sequence - 65536) % (65536 - rollover));
+}
+
+void TFTPTestClient::SendRequest()
+{
+    QByteArray packet;
+    packet.append((char)0);
+    packet.append((char)1);
+
+    QList<QByteArray> fields;
+    fields << filename.toUtf8() << "octet"
+           << "blksize" << QByteArray::number(blockSize)
+           << "windowsize" << QByteArray::number(windowSize)
+           << "rollover" << QByteArray::number(rollover)
+           << "tsize" << "0";
+
+    for (int i = 0; i < fields.size(); ++i)
+    {
+        packet.append(fields[i]);
+        packet.append((char)0);
+    }
+
+    sock->writeDatagram(packet, QHostAddress::LocalHost, serverPort);
+}
+
+void TFTPTestClient::SendAck(quint16 block)
+{
+    char packet[4];
+    qToBigEndian((quint16)4, (uchar*)packet);
+    qToBigEndian(block, (uchar*)packet + 2);
+    sock->writeDatagram(packet, sizeof(packet), peerAddr, peerPort);
+}
+
+bool TFTPTestClient::ParseOack(const QByteArray &packet)
+{
+    QList<QByteArray> fields = packet.mid(2).split(0);
+
+    bool sawRollover = false;
+
+    for (int i = 0; i + 1 < fields.size(); i += 2)
+    {
+        QByteArray name = fields[i].toLower();
+
+        if (name == "blksize")
+            blockSize = fields[i + 1].toInt();
+        else if (name == "windowsize")
+            windowSize = fields[i + 1].toInt();
+        else if (name == "rollover")
+            sawRollover = (fields[i + 1].toInt() == rollover);
+    }
+
+    if (!sawRollover)
+    {
+        error = "Server did not accept the rollover option";
+        return false;
+    }
+
+    return true;
+}
+
+void TFTPTestClient::run()
+{
+    QUdpSocket socket;
+    sock = &socket;
+
+    if (!sock->bind(QHostAddress::LocalHost, 0))
+    {
+        error = "Could not bind client socket";
+        return;
+    }
+
+    // Take a whole window of the biggest blocks without dropping any
+    sock->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption,
+                          8 << 20);
+
+    SendRequest();
+
+    QByteArray packet;
+    qint64 next = 1;
+    int inWindow = 0;
+    int idle = 0;
+
+    for (;;)
+    {
+        if (!sock->hasPendingDatagrams() && !sock->waitForReadyRead(200))
+        {
+            if (++idle > 25)
+            {
+                error = QString("Timed out at block %1").arg(next);
+                return;
+            }
+
+            // Nothing new, ask for the window again the way a client
+            // that lost blocks would
+            if (peerPort)
+            {
+                SendAck(WireBlock(next - 1));
+                inWindow = 0;
+            }
+            else
+            {
+                SendRequest();
+            }
+
+            continue;
+        }
+
+        packet.resize((int)sock->pendingDatagramSize());
+
+        QHostAddress addr;
+        quint16 port;
+        if (sock->readDatagram(packet.data(), packet.size(),
+                               &addr, &port) < 4)
+            continue;
+
+        quint16 opcode = qFromBigEndian<quint16>((const uchar*)packet.data());
+
+        if (opcode == 5)
+        {
+            error = QString("Server error: %1")
+                    .arg(QString::fromUtf8(packet.mid(4)));
+            return;
+        }
+
+        if (opcode == 6 && !peerPort)
+        {
+            peerAddr = addr;
+            peerPort = port;
+
+            if (!ParseOack(packet))
+                return;
+
+            SendAck(0);
+            continue;
+        }
+
+        if (opcode != 3 || port != peerPort)
+            continue;
+
+        quint16 block = qFromBigEndian<quint16>((const uchar*)packet.data() + 2);
+
+        // Duplicates and blocks past a loss, the timeout above
+        // sorts those out
+        if (block != WireBlock(next))
+            continue;
+
+        idle = 0;
+
+        int payload = packet.size() - 4;
+        received += payload;
+
+        if (next > 65535)
+            wrapped = true;
+        highestWire = qMax(highestWire, (int)block);
+
+        bool last = (payload < blockSize);
+
+        if (last || ++inWindow == windowSize || earlyAcks.contains(next))
+        {
+            SendAck(block);
+            inWindow = 0;
+        }
+
+        if (last)
+        {
+            lastBlock = next;
+            return;
+        }
+
+        ++next;
+    }
+}
+
+// Rollover only depends on the block count. Small blocks wrap with a
+// small file, a couple of hundred blocks past the wrap. The largest
+// blocks take a sparse file past 4GB, so offsets cross 2^32 too.
+// Neither is a multiple of its block size
+static const int smallBlockSize = 512;
+static const qint64 smallFileSize =
+        (Q_INT64_C(65536) + 200) * smallBlockSize + 123;
+
+static const int largeBlockSize = 65464;
+static const qint64 largeFileSize = (Q_INT64_C(1) << 32) + 12345;
+
+class TestTFTPRollover : public QObject
+{
+    Q_OBJECT
+
+    QTemporaryDir root;
+    TFTPServer *server;
+
+    bool CreateFile(const QString &name, qint64 size);
+
+private slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void transfer_data();
+    void transfer();
+};
+
+bool TestTFTPRollover::CreateFile(const QString &name, qint64 size)
+{
+    QFile file(root.path() + "/" + name);
+    if (!file.open(QFile::WriteOnly) || !file.resize(size))
+        return false;
+    file.close();
+
+    // Only world readable files are served
+    return file.setPermissions(file.permissions() | QFile::ReadOther);
+}
+
+void TestTFTPRollover::initTestCase()
+{
+    QVERIFY(root.isValid());
+
+    QVERIFY(CreateFile("small.img", smallFileSize));
+    QVERIFY(CreateFile("big.img", largeFileSize));
+
+    server = new TFTPServer(root.path());
+    server->SetPort(0);
+    server->SetWorkerCount(1);
+    server->SetMaxIdleTime(10000);
+    server->init();
+
+    QVERIFY(server->Port() != 0);
+}
+
+void TestTFTPRollover::cleanupTestCase()
+{
+    delete server;
+}
+
+void TestTFTPRollover::transfer_data()
+{
+    QTest::addColumn<QString>("filename");
+    QTest::addColumn<qint64>("fileSize");
+    QTest::addColumn<int>("blockSize");
+    QTest::addColumn<int>("rollover");
+    QTest::addColumn<int>("windowSize");
+    QTest::addColumn<QList<qint64> >("earlyAcks");
+
+    // Lock step, every ACK is one block. The one for 65536 is
+    // sent as 0 or 1
+    QTest::newRow("rollover=0 windowsize=1")
+            << "small.img" << smallFileSize << smallBlockSize
+            << 0 << 1 << QList<qint64>();
+    QTest::newRow("rollover=1 windowsize=1")
+            << "small.img" << smallFileSize << smallBlockSize
+            << 1 << 1 << QList<qint64>();
+
+    // Acknowledging block 1 early shifts every later window by one,
+    // so one spans 65535 and the wrap. Acknowledging 65536 early
+    // then lands in the middle of that window, on either side of
+    // the wrap depending on rollover
+    QList<qint64> straddle;
+    straddle << 1 << 65536;
+
+    QTest::newRow("rollover=0 windowsize=64")
+            << "small.img" << smallFileSize << smallBlockSize
+            << 0 << 64 << straddle;
+    QTest::newRow("rollover=1 windowsize=64")
+            << "small.img" << smallFileSize << smallBlockSize
+            << 1 << 64 << straddle;
+
+    // About 65.6K packets, offsets past 4GB
+    QTest::newRow("rollover=0 past 4GB")
+            << "big.img" << largeFileSize << largeBlockSize
+            << 0 << 1 << QList<qint64>();
+    QTest::newRow("rollover=1 past 4GB")
+            << "big.img" << largeFileSize << largeBlockSize
+            << 1 << 1 << QList<qint64>();
+}
+
+void TestTFTPRollover::transfer()
+{
+    QFETCH(QString, filename);
+    QFETCH(qint64, fileSize);
+    QFETCH(int, blockSize);
+    QFETCH(int, rollover);
+    QFETCH(int, windowSize);
+    QFETCH(QList<qint64>, earlyAcks);
+
+    TFTPTestClient client(server->Port(), filename, blockSize,
+                          windowSize, rollover, earlyAcks);
+
+    QEventLoop loop;
+    connect(&client, SIGNAL(finished()), &loop, SLOT(quit()));
+    client.start();
+    loop.exec();
+    client.wait();
+
+    QVERIFY2(client.error.isEmpty(), qPrintable(client.error));
+    QVERIFY(client.wrapped);
+    QCOMPARE(client.received, fileSize);
+    QCOMPARE(client.highestWire, 65535);
+}
+
+QTEST_MAIN(TestTFTPRollover)
+
+#include "tst_tftprollover.moc"
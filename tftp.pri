@@ -0,0 +1,6 @@
+# The TFTP server without the user interface, for the test and
+# benchmark targets
+INCLUDEPATH += $$PWD
+
+SOURCES += $$PWD/tftpserver.cpp $$PWD/tftptransfer.cpp $$PWD/tftpfilecache.cpp $$PWD/tftpmultiplexer.cpp $$PWD/udpbatch.cpp $$PWD/tftpmulticast.cpp $$PWD/tftpreadahead.cpp $$PWD/tftptimerwheel.cpp $$PWD/tftpsessiontable.cpp $$PWD/tftprequest.cpp $$PWD/tftpsessionpool.cpp $$PWD/tftpratelimiter.cpp $$PWD/tftpsendscheduler.cpp $$PWD/tftppathindex.cpp
+HEADERS += $$PWD/tftpserver.h $$PWD/tftptransfer.h $$PWD/tftpfilecache.h $$PWD/tftpmultiplexer.h $$PWD/udpbatch.h $$PWD/tftpmulticast.h $$PWD/tftpreadahead.h $$PWD/tftptimerwheel.h $$PWD/tftpsessiontable.h $$PWD/tftprequest.h $$PWD/tftpsessionpool.h $$PWD/tftpratelimiter.h $$PWD/tftpsendscheduler.h $$PWD/tftppathindex.h
@@ -0,0 +1,225 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftpfilecache.h"
+
+#include <QFileInfo>
+#include <QDateTime>
+#include <QRunnable>
+#include <QThreadPool>
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+// Reads a whole file for the cache, if it is still the file
+// that missed
+class TFTPFileCache::LoadTask : public QRunnable
+{
+    TFTPFileCache *cache;
+    QString filename;
+    Identity identity;
+
+public:
+    LoadTask(TFTPFileCache *cache, const QString &filename,
+             const Identity &identity)
+        : cache(cache)
+        , filename(filename)
+        , identity(identity)
+    {
+    }
+
+    void run()
+    {
+        QByteArray content;
+
+        QFile file(filename);
+        if (file.open(QFile::ReadOnly) &&
+                TFTPFileCache::Identify(filename, &file) == identity)
+            content = file.readAll();
+
+        cache->Loaded(filename, identity, content);
+    }
+};
+
+bool TFTPFileCache::Identity::operator==(const Identity &rhs) const
+{
+    return mtime == rhs.mtime && size == rhs.size && inode == rhs.inode;
+}
+
+TFTPFileCache::TFTPFileCache(qint64 budget)
+    : budget(budget)
+    , used(0)
+    , useCounter(0)
+    , hits(0)
+    , misses(0)
+    , evictions(0)
+{
+}
+
+TFTPFileCache::~TFTPFileCache()
+{
+    // Loads still running refer to us
+    QMutexLocker locker(&lock);
+    while (!loads.isEmpty())
+        loaded.wait(&lock);
+}
+
+void TFTPFileCache::SetBudget(qint64 bytes)
+{
+    QMutexLocker locker(&lock);
+    budget = bytes;
+    EvictTo(budget);
+}
+
+qint64 TFTPFileCache::Budget() const
+{
+    QMutexLocker locker(&lock);
+    return budget;
+}
+
+qint64 TFTPFileCache::Used() const
+{
+    QMutexLocker locker(&lock);
+    return used;
+}
+
+quint64 TFTPFileCache::Hits() const
+{
+    QMutexLocker locker(&lock);
+    return hits;
+}
+
+quint64 TFTPFileCache::Misses() const
+{
+    QMutexLocker locker(&lock);
+    return misses;
+}
+
+quint64 TFTPFileCache::Evictions() const
+{
+    QMutexLocker locker(&lock);
+    return evictions;
+}
+
+void TFTPFileCache::Remove(EntryMap::iterator entry)
+{
+    used -= entry.value().content.size();
+    entries.erase(entry);
+}
+
+void TFTPFileCache::EvictTo(qint64 limit)
+{
+    // Drop least recently used entries until the limit is met.
+    // A linear scan is fine, there are only ever a handful of
+    // distinct boot files
+    while (used > limit && !entries.isEmpty())
+    {
+        EntryMap::iterator oldest = entries.begin();
+        for (EntryMap::iterator i = entries.begin(); i != entries.end(); ++i)
+        {
+            if (i.value().lastUse < oldest.value().lastUse)
+                oldest = i;
+        }
+
+        Remove(oldest);
+        ++evictions;
+    }
+}
+
+TFTPFileCache::Identity TFTPFileCache::Identify(const QString &filename,
+                                                QFile *file)
+{
+    Identity identity;
+    identity.mtime = QFileInfo(filename).lastModified().toMSecsSinceEpoch();
+    identity.size = file->size();
+    identity.inode = 0;
+
+#ifdef Q_OS_UNIX
+    struct stat st;
+    if (fstat(file->handle(), &st) == 0)
+        identity.inode = st.st_ino;
+#endif
+
+    return identity;
+}
+
+QByteArray TFTPFileCache::Lookup(const QString &filename, QFile *file)
+{
+    Identity identity = Identify(filename, file);
+
+    QMutexLocker locker(&lock);
+
+    EntryMap::iterator i = entries.find(filename);
+    if (i != entries.end())
+    {
+        Entry &entry = i.value();
+
+        if (entry.identity == identity)
+        {
+            ++hits;
+            entry.lastUse = ++useCounter;
+            return entry.content;
+        }
+
+        // Stale, the file changed on disk
+        Remove(i);
+    }
+
+    ++misses;
+
+    // Already being read, by this version of the file or another.
+    // Either way this transfer doesn't wait for it
+    if (loads.contains(filename))
+        return QByteArray();
+
+    // Files that can never fit are served directly from disk
+    if (identity.size > budget ||
+            identity.size > std::numeric_limits<int>::max())
+        return QByteArray();
+
+    loads.insert(filename, identity);
+    QThreadPool::globalInstance()->start(
+                new LoadTask(this, filename, identity));
+
+    return QByteArray();
+}
+
+void TFTPFileCache::Loaded(const QString &filename,
+                           const Identity &identity,
+                           const QByteArray &content)
+{
+    QMutexLocker locker(&lock);
+
+    loads.remove(filename);
+    loaded.wakeAll();
+
+    // Short read, file changed under us or I/O error, the next miss
+    // tries again. The budget may have shrunk while reading
+    if (content.size() != identity.size || identity.size > budget)
+        return;
+
+    Entry entry;
+    entry.content = content;
+    entry.identity = identity;
+    entry.lastUse = ++useCounter;
+
+    EvictTo(budget - identity.size);
+
+    entries.insert(filename, entry);
+    used += identity.size;
+}
@@ -0,0 +1,107 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPFILECACHE_H
+#define TFTPFILECACHE_H
+
+#include <QByteArray>
+#include <QString>
+#include <QHash>
+#include <QFile>
+#include <QMutex>
+#include <QWaitCondition>
+
+// Process-wide cache of served file contents, shared by every
+// transfer. The content is a QByteArray, so a transfer holding it
+// keeps the bytes alive even after the cache evicts the entry.
+// Transfers run on worker threads, so all access is serialized.
+// Files are read into the cache on the global thread pool, never
+// by the transfer that missed
+class TFTPFileCache
+{
+    mutable QMutex lock;
+
+    // Identity of a file, a mismatch means the file was replaced
+    // or modified
+    struct Identity
+    {
+        qint64 mtime;
+        qint64 size;
+        quint64 inode;
+
+        bool operator==(const Identity &rhs) const;
+    };
+
+    static Identity Identify(const QString &filename, QFile *file);
+
+    struct Entry
+    {
+        QByteArray content;
+
+        // The file when it was loaded
+        Identity identity;
+
+        // Value of useCounter at the most recent lookup
+        quint64 lastUse;
+    };
+
+    typedef QHash<QString,Entry> EntryMap;
+    EntryMap entries;
+
+    // Files being read in the background. Lookups of them are
+    // served from disk until the read is done
+    class LoadTask;
+
+    typedef QHash<QString,Identity> LoadMap;
+    LoadMap loads;
+
+    // Signalled when a load finishes, the destructor waits for them
+    QWaitCondition loaded;
+
+    void Loaded(const QString &filename, const Identity &identity,
+                const QByteArray &content);
+
+    qint64 budget;
+    qint64 used;
+    quint64 useCounter;
+
+    quint64 hits;
+    quint64 misses;
+    quint64 evictions;
+
+    void Remove(EntryMap::iterator entry);
+    void EvictTo(qint64 limit);
+
+public:
+    static const qint64 defaultBudget = 64 * 1024 * 1024;
+
+    explicit TFTPFileCache(qint64 budget = defaultBudget);
+    ~TFTPFileCache();
+
+    void SetBudget(qint64 bytes);
+    qint64 Budget() const;
+    qint64 Used() const;
+
+    quint64 Hits() const;
+    quint64 Misses() const;
+    quint64 Evictions() const;
+
+    // Returns the content of the open file. A miss returns a null
+    // QByteArray and starts loading the file for later lookups,
+    // unless it does not fit in the budget
+    QByteArray Lookup(const QString &filename, QFile *file);
+};
+
+#endif // TFTPFILECACHE_H
@@ -0,0 +1,439 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftpmulticast.h"
+#include "tftptransfer.h"
+
+#include <QtEndian>
+#include <QNetworkInterface>
+
+typedef TFTPTransfer::BlockHeader BlockHeader;
+
+TFTPMulticastSession::TFTPMulticastSession(
+        const QString &filename, quint16 blockSize,
+        const QHostAddress &groupAddr, quint16 groupPort,
+        QObject *parent)
+    : QObject(parent)
+    , masterPending(false)
+    , filename(filename)
+    , file(nullptr)
+    , source(nullptr)
+    , fileSize(0)
+    , blockSize(blockSize)
+    , block(0)
+    , groupAddr(groupAddr)
+    , groupPort(groupPort)
+    , sock(nullptr)
+    , batch(1)
+    , recvBatch(16, TFTPTransfer::maxControlPacket)
+    , retransmitTimer(new QTimer(this))
+    , retransmitInterval(1000)
+    , retries(0)
+    , limiter(nullptr)
+    , paceTimer(new QTimer(this))
+    , pacedBlock(0)
+{
+    retransmitTimer->setSingleShot(true);
+    connect(retransmitTimer, SIGNAL(timeout()),
+            this, SLOT(OnRetransmitTimer()));
+
+    paceTimer->setSingleShot(true);
+    connect(paceTimer, SIGNAL(timeout()), this, SLOT(OnPaceTimer()));
+}
+
+void TFTPMulticastSession::SetRateLimiter(TFTPRateLimiter *rateLimiter)
+{
+    limiter = rateLimiter;
+}
+
+bool TFTPMulticastSession::Open(TFTPFileCache *cache, int ifindex)
+{
+    file = new QFile(filename, this);
+
+    if (!file->open(QFile::ReadOnly))
+        return false;
+
+    // File must be world readable
+    if ((file->permissions() & QFile::ReadOther) == 0)
+        return false;
+
+    fileSize = file->size();
+
+    // Masters join at arbitrary blocks, so block numbers must
+    // identify the offset unambiguously
+    if (fileSize / blockSize >= 65535)
+        return false;
+
+    content = cache->Lookup(filename, file);
+
+    if (!content.isNull())
+        source = content.constData();
+    else if (fileSize > 0)
+        source = (const char*)file->map(0, fileSize);
+
+    // Every client gets the same blocks, only memory backed
+    // files are worth it
+    if (!source)
+        return false;
+
+    sock = new QUdpSocket(this);
+
+    // IPv4 only, the multicast options below are per protocol
+    if (!sock->bind(QHostAddress::AnyIPv4, 0))
+        return false;
+
+    sock->setSocketOption(QAbstractSocket::MulticastTtlOption, multicastTtl);
+
+    // The route to a multicast group says nothing about which link the
+    // clients are on, send out the one the request came in on
+    if (ifindex)
+    {
+        QNetworkInterface iface = QNetworkInterface::interfaceFromIndex(ifindex);
+
+        if (iface.isValid())
+            sock->setMulticastInterface(iface);
+    }
+
+    connect(sock, SIGNAL(readyRead()), this, SLOT(OnPacketReceived()));
+
+    batch.SetSocket(sock);
+
+    emit verboseEvent(QString("TFTP: Multicast session for %1 on %2:%3")
+                      .arg(filename)
+                      .arg(groupAddr.toString())
+                      .arg(groupPort));
+
+    return true;
+}
+
+quint16 TFTPMulticastSession::BlockSize() const
+{
+    return blockSize;
+}
+
+const QHostAddress &TFTPMulticastSession::GroupAddress() const
+{
+    return groupAddr;
+}
+
+int TFTPMulticastSession::Clients() const
+{
+    return clients.size();
+}
+
+int TFTPMulticastSession::Clients(const QHostAddress &addr) const
+{
+    int count = 0;
+
+    for (int i = 0; i < clients.size(); ++i)
+    {
+        if (clients[i].addr == addr)
+            ++count;
+    }
+
+    return count;
+}
+
+bool TFTPMulticastSession::HasClient(const QHostAddress &addr,
+                                     quint16 port) const
+{
+    for (int i = 0; i < clients.size(); ++i)
+    {
+        if (clients[i].addr == addr && clients[i].port == port)
+            return true;
+    }
+
+    return false;
+}
+
+qint64 TFTPMulticastSession::BlockOffset(quint16 blockNumber) const
+{
+    return (qint64)(blockNumber - 1) * blockSize;
+}
+
+bool TFTPMulticastSession::IsLastBlock(quint16 blockNumber) const
+{
+    return blockNumber > 0 &&
+            fileSize - BlockOffset(blockNumber) < blockSize;
+}
+
+void TFTPMulticastSession::AddClient(const QHostAddress &addr, quint16 port,
+                                     const TFTPRequest &request)
+{
+    Client client;
+    client.addr = addr;
+    client.port = port;
+
+    // A repeated request, the OACK was probably lost. Answer it again
+    // rather than adding a second client that would never ACK
+    for (int i = 0; i < clients.size(); ++i)
+    {
+        if (clients[i].addr != addr || clients[i].port != port)
+            continue;
+
+        if (i == 0 && masterPending)
+            sock->writeDatagram(masterOack, addr, port);
+        else if (i != 0)
+            SendOack(client, false, request);
+
+        emit verboseEvent(QString("TFTP: Answered duplicate multicast"
+                                  " request from %1:%2")
+                          .arg(addr.toString()).arg(port));
+        return;
+    }
+
+    clients.append(client);
+
+    bool master = (clients.size() == 1);
+
+    // A late joiner picks up blocks from the group right away and
+    // asks for the ones it missed once it becomes master
+    QByteArray oack = SendOack(client, master, request);
+
+    if (master)
+    {
+        masterOack = oack;
+        masterPending = true;
+        retries = 0;
+        retransmitTimer->start(retransmitInterval);
+    }
+
+    emit verboseEvent(QString("TFTP: %1:%2 joined multicast %3 (%4 clients)")
+                      .arg(addr.toString()).arg(port)
+                      .arg(filename).arg(clients.size()));
+}
+
+QByteArray TFTPMulticastSession::SendOack(const Client &client, bool master,
+        const TFTPRequest &request)
+{
+    QByteArray oack;
+    oack.append((char)0);
+    oack.append((char)TFTPTransfer::OACK);
+
+    oack.append(u8"multicast");
+    oack.append((char)0);
+    oack.append(QString("%1,%2,%3")
+                .arg(groupAddr.toString())
+                .arg(groupPort)
+                .arg(master ? 1 : 0).toUtf8());
+    oack.append((char)0);
+
+    if (request.Value(TFTPRequest::TSIZE))
+    {
+        oack.append(u8"tsize");
+        oack.append((char)0);
+        oack.append(QString("%1").arg(fileSize).toUtf8());
+        oack.append((char)0);
+    }
+
+    if (request.Value(TFTPRequest::BLKSIZE))
+    {
+        oack.append(u8"blksize");
+        oack.append((char)0);
+        oack.append(QString("%1").arg(blockSize).toUtf8());
+        oack.append((char)0);
+    }
+
+    qint64 sentSize = sock->writeDatagram(oack, client.addr, client.port);
+
+    if (sentSize != oack.size())
+        emit ErrorEvent("Outbound multicast OACK packet truncated!");
+
+    return oack;
+}
+
+void TFTPMulticastSession::SendBlock(quint16 blockNumber)
+{
+    BlockHeader header;
+    header.opcode = qToBigEndian((quint16)TFTPTransfer::DATA);
+    header.block = qToBigEndian(blockNumber);
+
+    qint64 offset = BlockOffset(blockNumber);
+    qint64 payloadSize = qMin((qint64)blockSize, fileSize - offset);
+
+    batch.Queue(groupAddr, groupPort, &header, sizeof(header),
+                source + offset, payloadSize);
+
+    if (batch.Flush() != 1)
+        emit ErrorEvent("Outbound multicast DATA packet dropped!");
+
+    block = blockNumber;
+}
+
+void TFTPMulticastSession::NextMaster()
+{
+    retransmitTimer->stop();
+    paceTimer->stop();
+
+    if (clients.isEmpty())
+    {
+        emit verboseEvent(QString("TFTP: Multicast %1 complete")
+                          .arg(filename));
+        emit finished(filename);
+        deleteLater();
+        return;
+    }
+
+    // The new master acknowledges the block before the first one
+    // it is missing, or the last block if it has them all
+    masterOack = SendOack(clients.first(), true, TFTPRequest());
+
+    masterPending = true;
+    retries = 0;
+    retransmitTimer->start(retransmitInterval);
+}
+
+void TFTPMulticastSession::OnPacketReceived()
+{
+    int count;
+
+    while ((count = recvBatch.Receive(sock)) > 0)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (recvBatch.Size(i) < 0)
+                continue;
+
+            ProcessDatagram(recvBatch.Data(i), recvBatch.Size(i),
+                            recvBatch.Address(i), recvBatch.Port(i));
+        }
+    }
+}
+
+void TFTPMulticastSession::ProcessDatagram(const char *data, int size,
+        const QHostAddress &addr, quint16 port)
+{
+    if (size < (int)sizeof(BlockHeader) || clients.isEmpty())
+        return;
+
+    const BlockHeader *headerPtr = (const BlockHeader*)data;
+    quint16 opcode = qFromBigEndian(headerPtr->opcode);
+    quint16 ackBlock = qFromBigEndian(headerPtr->block);
+
+    bool fromMaster = (clients.first().addr == addr &&
+                       clients.first().port == port);
+
+    if (opcode == TFTPTransfer::ERROR)
+    {
+        // The client gave up, forget it
+        for (int i = 0; i < clients.size(); ++i)
+        {
+            if (clients[i].addr == addr && clients[i].port == port)
+            {
+                clients.removeAt(i);
+                break;
+            }
+        }
+
+        if (fromMaster)
+            NextMaster();
+
+        return;
+    }
+
+    // Only the master acknowledges
+    if (opcode != TFTPTransfer::ACK || !fromMaster)
+        return;
+
+    if (ackBlock > 0 && BlockOffset(ackBlock) > fileSize)
+        return;
+
+    masterPending = false;
+    retries = 0;
+
+    if (IsLastBlock(ackBlock))
+    {
+        emit verboseEvent(QString("TFTP: Multicast master %1:%2 done")
+                          .arg(addr.toString()).arg(port));
+
+        clients.removeFirst();
+        NextMaster();
+        return;
+    }
+
+    PaceBlock(ackBlock + 1);
+}
+
+void TFTPMulticastSession::OnRetransmitTimer()
+{
+    if (clients.isEmpty())
+        return;
+
+    // The master went away, let the next client carry on
+    if (++retries > maxRetries)
+    {
+        emit ErrorEvent(QString("Multicast master %1:%2 timed out")
+                        .arg(clients.first().addr.toString())
+                        .arg(clients.first().port));
+
+        clients.removeFirst();
+        NextMaster();
+        return;
+    }
+
+    if (masterPending)
+    {
+        const Client &master = clients.first();
+        sock->writeDatagram(masterOack, master.addr, master.port);
+    }
+    else
+    {
+        PaceBlock(block);
+        return;
+    }
+
+    retransmitTimer->start(retransmitInterval);
+}
+
+void TFTPMulticastSession::PaceBlock(quint16 blockNumber)
+{
+    // Already paid for one packet, send this block in its place
+    if (paceTimer->isActive())
+    {
+        pacedBlock = blockNumber;
+        return;
+    }
+
+    int wait = 0;
+
+    // The group counts against the global rate like any client
+    if (limiter && limiter->IsLimited())
+    {
+        qint64 offset = BlockOffset(blockNumber);
+        wait = limiter->Take(sizeof(BlockHeader) +
+                             qMin((qint64)blockSize, fileSize - offset));
+    }
+
+    if (wait > 0)
+    {
+        // The master can't be blamed for a block not sent yet
+        retransmitTimer->stop();
+        pacedBlock = blockNumber;
+        paceTimer->start(wait);
+        return;
+    }
+
+    SendBlock(blockNumber);
+    retransmitTimer->start(retransmitInterval);
+}
+
+void TFTPMulticastSession::OnPaceTimer()
+{
+    if (clients.isEmpty())
+        return;
+
+    SendBlock(pacedBlock);
+    retransmitTimer->start(retransmitInterval);
+}
@@ -0,0 +1,133 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPMULTICAST_H
+#define TFTPMULTICAST_H
+
+#include <QObject>
+#include <QHostAddress>
+#include <QUdpSocket>
+#include <QFile>
+#include <QTimer>
+#include <QList>
+
+#include "tftpserver.h"
+#include "tftpfilecache.h"
+#include "tftpratelimiter.h"
+#include "udpbatch.h"
+
+// RFC 2090 multicast transfer of one file to every client that asks
+// for it. DATA goes to the group, one master client at a time
+// acknowledges it. When the master is done the next client becomes
+// master and acknowledges the blocks it is still missing
+class TFTPMulticastSession : public QObject
+{
+    Q_OBJECT
+
+    struct Client
+    {
+        QHostAddress addr;
+        quint16 port;
+    };
+
+    // The first client is the master
+    QList<Client> clients;
+
+    // The master was sent its OACK but hasn't acknowledged yet
+    bool masterPending;
+    QByteArray masterOack;
+
+    QString filename;
+    QFile *file;
+    QByteArray content;
+    const char *source;
+    qint64 fileSize;
+
+    quint16 blockSize;
+
+    // Last block sent to the group, 0 if none yet
+    quint16 block;
+
+    QHostAddress groupAddr;
+    quint16 groupPort;
+
+    QUdpSocket *sock;
+    UdpSendBatch batch;
+    UdpRecvBatch recvBatch;
+
+    QTimer *retransmitTimer;
+    int retransmitInterval;
+    int retries;
+
+    // Holds the next block back until the global rate allows it.
+    // Its tokens are already taken
+    TFTPRateLimiter *limiter;
+    QTimer *paceTimer;
+    quint16 pacedBlock;
+
+    static const int maxRetries = 5;
+
+    // Boot clients are on the local link, keep the group there
+    static const int multicastTtl = 1;
+
+    QByteArray SendOack(const Client &client, bool master,
+                        const TFTPRequest &request);
+    void SendBlock(quint16 blockNumber);
+    void PaceBlock(quint16 blockNumber);
+    void ProcessDatagram(const char *data, int size,
+                         const QHostAddress &addr, quint16 port);
+    void NextMaster();
+
+    qint64 BlockOffset(quint16 blockNumber) const;
+    bool IsLastBlock(quint16 blockNumber) const;
+
+public:
+    TFTPMulticastSession(const QString &filename, quint16 blockSize,
+                         const QHostAddress &groupAddr, quint16 groupPort,
+                         QObject *parent = 0);
+
+    // Opens the file, returns false if it can't be served by multicast.
+    // DATA goes out the interface with the given index, or the
+    // default one if 0
+    bool Open(TFTPFileCache *cache, int ifindex);
+
+    void SetRateLimiter(TFTPRateLimiter *rateLimiter);
+
+    quint16 BlockSize() const;
+    const QHostAddress &GroupAddress() const;
+
+    int Clients() const;
+    int Clients(const QHostAddress &addr) const;
+    bool HasClient(const QHostAddress &addr, quint16 port) const;
+
+    // Adds a client, the first one becomes master. A client that is
+    // already in the session is only sent its OACK again
+    void AddClient(const QHostAddress &addr, quint16 port,
+                   const TFTPRequest &request);
+
+signals:
+    void verboseEvent(const QString &msg);
+    void ErrorEvent(const QString &msg);
+
+    // Every client has the whole file
+    void finished(const QString &filename);
+
+public slots:
+    void OnPacketReceived();
+    void OnRetransmitTimer();
+    void OnPaceTimer();
+};
+
+#endif // TFTPMULTICAST_H
@@ -0,0 +1,169 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftpmultiplexer.h"
+#include "tftptransfer.h"
+
+bool TFTPMultiplexer::Key::operator==(const Key &rhs) const
+{
+    return clientPort == rhs.clientPort &&
+            serverPort == rhs.serverPort &&
+            clientAddr == rhs.clientAddr;
+}
+
+uint qHash(const TFTPMultiplexer::Key &key, uint seed)
+{
+    return qHash(key.clientAddr, seed) ^
+            ((uint)key.clientPort << 16) ^ key.serverPort;
+}
+
+TFTPMultiplexer::TFTPMultiplexer(QObject *parent)
+    : QObject(parent)
+    , sock(nullptr)
+    , recvBatch(32, 516)
+    , sendBatch(64)
+    , flushScheduled(false)
+{
+}
+
+TFTPMultiplexer::~TFTPMultiplexer()
+{
+    // At shutdown the transfers may be deleted after us
+    for (SessionMap::iterator i = sessions.begin(); i != sessions.end(); ++i)
+        i.value()->DetachMultiplexer();
+}
+
+void TFTPMultiplexer::Open()
+{
+    // Created here so the socket belongs to this object's thread
+    sock = new QUdpSocket(this);
+
+    if (!sock->bind(0))
+    {
+        emit errorEvent("TFTP: Multiplexed socket bind(0) failed!");
+
+        // Transfers on this thread see no socket and fail to start
+        delete sock;
+        sock = nullptr;
+        return;
+    }
+
+    connect(sock, SIGNAL(readyRead()), this, SLOT(OnPacketReceived()));
+
+    sendBatch.SetSocket(sock);
+
+    emit verboseEvent(QString("TFTP: Multiplexed socket on port %1")
+                      .arg(sock->localPort()));
+}
+
+QUdpSocket *TFTPMultiplexer::Socket() const
+{
+    return sock;
+}
+
+UdpSendBatch *TFTPMultiplexer::SendBatch()
+{
+    return &sendBatch;
+}
+
+void TFTPMultiplexer::ScheduleFlush()
+{
+    if (flushScheduled)
+        return;
+
+    flushScheduled = true;
+    QMetaObject::invokeMethod(this, "Flush", Qt::QueuedConnection);
+}
+
+void TFTPMultiplexer::Flush()
+{
+    flushScheduled = false;
+
+    int queued = sendBatch.Pending();
+    if (sendBatch.Flush() != queued)
+        emit errorEvent("TFTP: Outbound DATA packets dropped!");
+}
+
+int TFTPMultiplexer::SessionCount() const
+{
+    return sessions.size();
+}
+
+bool TFTPMultiplexer::Register(const QHostAddress &addr, quint16 port,
+                               TFTPTransfer *transfer)
+{
+    Key key;
+    key.clientAddr = addr;
+    key.clientPort = port;
+    key.serverPort = sock->localPort();
+
+    // Two transfers with the same client can't be told apart on the
+    // shared socket
+    SessionMap::const_iterator i = sessions.constFind(key);
+    if (i != sessions.constEnd() && i.value() != transfer)
+        return false;
+
+    sessions.insert(key, transfer);
+    return true;
+}
+
+void TFTPMultiplexer::Unregister(const QHostAddress &addr, quint16 port,
+                                 TFTPTransfer *transfer)
+{
+    Key key;
+    key.clientAddr = addr;
+    key.clientPort = port;
+    key.serverPort = sock->localPort();
+
+    SessionMap::iterator i = sessions.find(key);
+    if (i != sessions.end() && i.value() == transfer)
+        sessions.erase(i);
+}
+
+void TFTPMultiplexer::OnPacketReceived()
+{
+    Key key;
+    key.serverPort = sock->localPort();
+
+    int count;
+
+    while ((count = recvBatch.Receive(sock)) > 0)
+    {
+        for (int n = 0; n < count; ++n)
+        {
+            int size = recvBatch.Size(n);
+
+            // Oversized, can't be an ACK
+            if (size < 0)
+                continue;
+
+            key.clientAddr = recvBatch.Address(n);
+            key.clientPort = recvBatch.Port(n);
+
+            SessionMap::iterator i = sessions.find(key);
+            if (i == sessions.end())
+            {
+                emit verboseEvent(QString("TFTP: Dropped packet from unknown"
+                                          " transfer %1:%2")
+                                  .arg(key.clientAddr.toString())
+                                  .arg(key.clientPort));
+                continue;
+            }
+
+            i.value()->ProcessDatagram(recvBatch.Data(n), size,
+                                       key.clientAddr, key.clientPort);
+        }
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPMULTIPLEXER_H
+#define TFTPMULTIPLEXER_H
+
+#include <QObject>
+#include <QHash>
+#include <QHostAddress>
+#include <QUdpSocket>
+
+#include "udpbatch.h"
+
+class TFTPTransfer;
+
+// Carries many transfers over one server socket, instead of one
+// socket per transfer. Lives on the same thread as its transfers
+class TFTPMultiplexer : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Key
+    {
+        QHostAddress clientAddr;
+        quint16 clientPort;
+        quint16 serverPort;
+
+        bool operator==(const Key &rhs) const;
+    };
+
+private:
+    typedef QHash<Key,TFTPTransfer*> SessionMap;
+    SessionMap sessions;
+
+    QUdpSocket *sock;
+
+    UdpRecvBatch recvBatch;
+
+    // DATA from all transfers, flushed once per event loop pass
+    UdpSendBatch sendBatch;
+    bool flushScheduled;
+
+public:
+    explicit TFTPMultiplexer(QObject *parent = 0);
+    ~TFTPMultiplexer();
+
+    QUdpSocket *Socket() const;
+    UdpSendBatch *SendBatch();
+
+    // Flush sendBatch when control returns to the event loop
+    void ScheduleFlush();
+    int SessionCount() const;
+
+    // Routes the client's packets to transfer. Refused if another
+    // transfer already has the client's address and port
+    bool Register(const QHostAddress &addr, quint16 port,
+                  TFTPTransfer *transfer);
+
+    // Only if transfer is the one registered
+    void Unregister(const QHostAddress &addr, quint16 port,
+                    TFTPTransfer *transfer);
+
+signals:
+    void verboseEvent(const QString &msg);
+    void errorEvent(const QString &msg);
+
+public slots:
+    void Open();
+    void Flush();
+    void OnPacketReceived();
+};
+
+uint qHash(const TFTPMultiplexer::Key &key, uint seed = 0);
+
+#endif // TFTPMULTIPLEXER_H
@@ -0,0 +1,211 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftppathindex.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QStringList>
+
+TFTPPathIndex::TFTPPathIndex(const QString &root, QObject *parent)
+    : QObject(parent)
+    , root(root)
+    , watcher(new QFileSystemWatcher(this))
+    , hits(0)
+    , misses(0)
+    , notFound(0)
+{
+    connect(watcher, SIGNAL(directoryChanged(QString)),
+            this, SLOT(OnDirectoryChanged(QString)));
+}
+
+bool TFTPPathIndex::Split(const char *filename, QStringList *components)
+{
+    QString name = QString::fromUtf8(filename);
+    name.replace(QChar('\\'), QChar('/'));
+
+    components->clear();
+
+    QStringList parts = name.split(QChar('/'), QString::SkipEmptyParts);
+
+    for (int i = 0; i < parts.size(); ++i)
+    {
+        // Names like "a..b" are fine, only a ".." component can
+        // climb out of the root
+        if (parts[i] == "..")
+            return false;
+
+        if (parts[i] != ".")
+            components->append(parts[i]);
+    }
+
+    return true;
+}
+
+QString TFTPPathIndex::FullPath(const QString &directory) const
+{
+    // An empty root is the root of the filesystem
+    if (directory.isEmpty())
+        return root.isEmpty() ? QString("/") : root;
+
+    return root + '/' + directory;
+}
+
+TFTPPathIndex::Listing TFTPPathIndex::List(const QString &directory,
+                                           bool *watched)
+{
+    QHash<QString,Listing>::const_iterator i = listings.constFind(directory);
+    if (i != listings.constEnd())
+        return i.value();
+
+    QString fullPath = FullPath(directory);
+
+    // Watch before listing, a change in between only costs a relist.
+    // Out of watches, list it every time
+    bool watching = watcher->addPath(fullPath);
+    if (!watching)
+        *watched = false;
+
+    Listing listing;
+
+    QFileInfoList entries = QDir(fullPath).entryInfoList(
+                QDir::AllEntries | QDir::Hidden | QDir::System |
+                QDir::NoDotAndDotDot);
+
+    for (int n = 0; n < entries.size(); ++n)
+        listing.insert(entries[n].fileName(), entries[n].isDir());
+
+    if (watching)
+        listings.insert(directory, listing);
+
+    return listing;
+}
+
+bool TFTPPathIndex::Lookup(const char *filename, QString *path,
+                           bool *watched)
+{
+    QStringList components;
+
+    if (!Split(filename, &components) || components.isEmpty())
+        return false;
+
+    QString directory;
+
+    for (int i = 0; i < components.size(); ++i)
+    {
+        Listing listing = List(directory, watched);
+        Listing::const_iterator entry = listing.constFind(components[i]);
+
+        if (entry == listing.constEnd())
+            return false;
+
+        bool last = (i + 1 == components.size());
+
+        // Every component but the last is a directory, the last isn't
+        if (entry.value() != !last)
+            return false;
+
+        if (!directory.isEmpty())
+            directory += '/';
+        directory += components[i];
+    }
+
+    *path = root + '/' + directory;
+    return true;
+}
+
+bool TFTPPathIndex::Resolve(const char *filename, QString *path)
+{
+    QByteArray key(filename);
+
+    QHash<QByteArray,Result>::const_iterator i = lookups.constFind(key);
+    if (i != lookups.constEnd())
+    {
+        ++hits;
+
+        if (!i.value().found)
+            ++notFound;
+
+        *path = i.value().path;
+        return i.value().found;
+    }
+
+    ++misses;
+
+    Result result;
+    bool watched = true;
+    result.found = Lookup(filename, &result.path, &watched);
+
+    if (!result.found)
+        ++notFound;
+
+    if (!watched)
+    {
+        *path = result.path;
+        return result.found;
+    }
+
+    // Probes are mostly for the same few names, start over rather
+    // than grow without bound when something sprays random names
+    if (lookups.size() >= maxLookups)
+        lookups.clear();
+
+    lookups.insert(key, result);
+
+    *path = result.path;
+    return result.found;
+}
+
+void TFTPPathIndex::OnDirectoryChanged(const QString &path)
+{
+    QString directory;
+
+    if (path.size() > root.size())
+        directory = path.mid(root.size() + 1);
+
+    // The directory and anything under it are listed again on demand.
+    // It may be gone, the watcher stops watching it by itself
+    QHash<QString,Listing>::iterator i = listings.begin();
+    while (i != listings.end())
+    {
+        if (directory.isEmpty() || i.key() == directory ||
+                i.key().startsWith(directory + '/'))
+        {
+            watcher->removePath(FullPath(i.key()));
+            i = listings.erase(i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    lookups.clear();
+}
+
+quint64 TFTPPathIndex::Hits() const
+{
+    return hits;
+}
+
+quint64 TFTPPathIndex::Misses() const
+{
+    return misses;
+}
+
+quint64 TFTPPathIndex::NotFound() const
+{
+    return notFound;
+}
@@ -0,0 +1,85 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPPATHINDEX_H
+#define TFTPPATHINDEX_H
+
+#include <QObject>
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+#include <QFileSystemWatcher>
+
+// Listings of the directories under the server root, kept in memory
+// and dropped when the filesystem watcher (inotify on Linux) reports
+// a change. Requested filenames are resolved against the listings,
+// so the many paths a boot loader probes for that don't exist never
+// touch the filesystem. Lives on the listener's thread
+class TFTPPathIndex : public QObject
+{
+    Q_OBJECT
+
+    QString root;
+
+    // Names in a directory, true for subdirectories
+    typedef QHash<QString,bool> Listing;
+
+    // By path relative to the root, "" is the root itself
+    QHash<QString,Listing> listings;
+
+    // Results by requested filename, found or not
+    struct Result
+    {
+        bool found;
+        QString path;
+    };
+
+    QHash<QByteArray,Result> lookups;
+
+    QFileSystemWatcher *watcher;
+
+    quint64 hits;
+    quint64 misses;
+    quint64 notFound;
+
+    static const int maxLookups = 4096;
+
+    // Listings and results are only kept while the watcher covers
+    // every directory they came from, otherwise nothing would ever
+    // tell us they went stale. Watched is cleared if one isn't
+    QString FullPath(const QString &directory) const;
+    Listing List(const QString &directory, bool *watched);
+    bool Lookup(const char *filename, QString *path, bool *watched);
+
+public:
+    explicit TFTPPathIndex(const QString &root, QObject *parent = 0);
+
+    // Full path of a regular file under the root, false if the name
+    // is outside the root, a directory, or doesn't exist
+    bool Resolve(const char *filename, QString *path);
+
+    // Splits a requested filename into path components. Either
+    // separator is accepted. False if any component is ".."
+    static bool Split(const char *filename, QStringList *components);
+
+    quint64 Hits() const;
+    quint64 Misses() const;
+    quint64 NotFound() const;
+
+private slots:
+    void OnDirectoryChanged(const QString &path);
+};
+
+#endif // TFTPPATHINDEX_H
@@ -0,0 +1,162 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftpratelimiter.h"
+
+TFTPRateLimiter::TFTPRateLimiter()
+    : globalRate(0)
+    , clientRate(0)
+    , lastPrune(0)
+{
+    clock.start();
+}
+
+TFTPRateLimiter::~TFTPRateLimiter()
+{
+    qDeleteAll(clients);
+}
+
+void TFTPRateLimiter::SetGlobalRate(qint64 bytesPerSecond)
+{
+    globalRate = bytesPerSecond;
+    global.full.store(0);
+}
+
+void TFTPRateLimiter::SetClientRate(qint64 bytesPerSecond)
+{
+    QWriteLocker locker(&clientsLock);
+
+    clientRate = bytesPerSecond;
+    qDeleteAll(clients);
+    clients.clear();
+}
+
+bool TFTPRateLimiter::IsLimited() const
+{
+    // Only set before the server starts
+    return globalRate > 0 || clientRate > 0;
+}
+
+qint64 TFTPRateLimiter::Now() const
+{
+    return clock.nsecsElapsed() / 1000;
+}
+
+qint64 TFTPRateLimiter::Burst(qint64 rate)
+{
+    // A tenth of a second worth, but always at least the largest
+    // DATA packet so any block can eventually be sent
+    return qMax(rate / 10, (qint64)65536);
+}
+
+qint64 TFTPRateLimiter::Reserve(Bucket *bucket, qint64 rate, qint64 bytes,
+                                qint64 now)
+{
+    qint64 cost = bytes * 1000000 / rate;
+    qint64 depth = Burst(rate) * 1000000 / rate;
+
+    qint64 full;
+    qint64 next;
+
+    // A full bucket can't get any fuller, refill starts from now
+    do
+    {
+        full = bucket->full.load();
+        next = qMax(full, now) + cost;
+    }
+    while (!bucket->full.testAndSetOrdered(full, next));
+
+    // Microseconds until the bucket held enough for these bytes
+    return qMax((qint64)0, next - depth - now);
+}
+
+qint64 TFTPRateLimiter::TakeClient(const QHostAddress &client, qint64 bytes,
+                                   qint64 now)
+{
+    if (now - lastPrune.load() > 10000000)
+        Prune(now);
+
+    {
+        QReadLocker locker(&clientsLock);
+
+        Bucket *bucket = clients.value(client);
+        if (bucket)
+            return Reserve(bucket, clientRate, bytes, now);
+    }
+
+    QWriteLocker locker(&clientsLock);
+
+    // Another thread may have added it in between
+    Bucket *&bucket = clients[client];
+    if (!bucket)
+    {
+        bucket = new Bucket;
+        bucket->full.store(0);
+    }
+
+    return Reserve(bucket, clientRate, bytes, now);
+}
+
+void TFTPRateLimiter::Prune(qint64 now)
+{
+    qint64 last = lastPrune.load();
+
+    // One thread does it
+    if (!lastPrune.testAndSetOrdered(last, now))
+        return;
+
+    QWriteLocker locker(&clientsLock);
+
+    // A bucket that has had time to fill up is the same as no bucket
+    QHash<QHostAddress,Bucket*>::iterator i = clients.begin();
+    while (i != clients.end())
+    {
+        if (i.value()->full.load() <= now)
+        {
+            delete i.value();
+            i = clients.erase(i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+int TFTPRateLimiter::Take(const QHostAddress &client, qint64 bytes)
+{
+    if (!IsLimited())
+        return 0;
+
+    qint64 now = Now();
+    qint64 wait = 0;
+
+    if (globalRate > 0)
+        wait = Reserve(&global, globalRate, bytes, now);
+
+    if (clientRate > 0)
+        wait = qMax(wait, TakeClient(client, bytes, now));
+
+    // Round up to whole milliseconds
+    return (int)((wait + 999) / 1000);
+}
+
+int TFTPRateLimiter::Take(qint64 bytes)
+{
+    if (globalRate <= 0)
+        return 0;
+
+    return (int)((Reserve(&global, globalRate, bytes, Now()) + 999) / 1000);
+}
@@ -0,0 +1,77 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPRATELIMITER_H
+#define TFTPRATELIMITER_H
+
+#include <QHash>
+#include <QHostAddress>
+#include <QReadWriteLock>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+
+// Token buckets limiting the DATA rate of all transfers together,
+// and of each client. Shared by all the worker threads, so a bucket
+// is kept as the time it will next be full, which one atomic
+// compare and swap can advance
+class TFTPRateLimiter
+{
+    struct Bucket
+    {
+        // Microseconds on clock. Anything up to now means full
+        QAtomicInteger<qint64> full;
+    };
+
+    QElapsedTimer clock;
+
+    // Bytes per second, 0 is unlimited
+    qint64 globalRate;
+    qint64 clientRate;
+
+    Bucket global;
+
+    // Only inserting and pruning clients takes the write lock
+    QReadWriteLock clientsLock;
+    QHash<QHostAddress,Bucket*> clients;
+    QAtomicInteger<qint64> lastPrune;
+
+    static qint64 Burst(qint64 rate);
+    static qint64 Reserve(Bucket *bucket, qint64 rate, qint64 bytes,
+                          qint64 now);
+
+    qint64 Now() const;
+    qint64 TakeClient(const QHostAddress &client, qint64 bytes, qint64 now);
+    void Prune(qint64 now);
+
+public:
+    TFTPRateLimiter();
+    ~TFTPRateLimiter();
+
+    void SetGlobalRate(qint64 bytesPerSecond);
+    void SetClientRate(qint64 bytesPerSecond);
+
+    bool IsLimited() const;
+
+    // Takes bytes from the global and the client's bucket, even when
+    // they don't hold that many yet. Returns 0 if the bytes may be
+    // sent now, otherwise the milliseconds to wait before sending
+    // them. They are paid for either way, don't take them again
+    int Take(const QHostAddress &client, qint64 bytes);
+
+    // Same, from the global bucket only
+    int Take(qint64 bytes);
+};
+
+#endif // TFTPRATELIMITER_H
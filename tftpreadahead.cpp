@@ -0,0 +1,173 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftpreadahead.h"
+
+#include <QRunnable>
+#include <QThreadPool>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class TFTPReadAhead::ReadTask : public QRunnable
+{
+    QSharedPointer<TFTPReadAhead> owner;
+    QVector<int> slotIndices;
+
+public:
+    ReadTask(const QSharedPointer<TFTPReadAhead> &owner,
+             const QVector<int> &slotIndices)
+        : owner(owner)
+        , slotIndices(slotIndices)
+    {
+    }
+
+    void run()
+    {
+        owner->Load(slotIndices);
+    }
+};
+
+TFTPReadAhead::TFTPReadAhead(int fd, int blockSize,
+                             qint64 fileSize, int depth)
+    : ring(depth)
+    , fd(fd)
+    , blockSize(blockSize)
+    , fileSize(fileSize)
+{
+    for (int i = 0; i < ring.size(); ++i)
+    {
+        ring[i].offset = -1;
+        ring[i].state = EMPTY;
+        ring[i].data.resize(blockSize);
+        ring[i].size = 0;
+    }
+}
+
+TFTPReadAhead::~TFTPReadAhead()
+{
+#ifdef Q_OS_UNIX
+    close(fd);
+#endif
+}
+
+QSharedPointer<TFTPReadAhead> TFTPReadAhead::Create(
+        int fd, int blockSize, qint64 fileSize, int depth)
+{
+#ifdef Q_OS_UNIX
+    int own = dup(fd);
+    if (own < 0)
+        return QSharedPointer<TFTPReadAhead>();
+
+#ifdef Q_OS_LINUX
+    posix_fadvise(own, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    return QSharedPointer<TFTPReadAhead>(
+                new TFTPReadAhead(own, blockSize, fileSize, depth));
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(blockSize);
+    Q_UNUSED(fileSize);
+    Q_UNUSED(depth);
+    return QSharedPointer<TFTPReadAhead>();
+#endif
+}
+
+bool TFTPReadAhead::Take(qint64 offset, char *dest, qint64 *size)
+{
+    QMutexLocker locker(&lock);
+
+    Slot &slot = ring[(offset / blockSize) % ring.size()];
+
+    if (slot.offset != offset || slot.state != READY)
+        return false;
+
+    // Stays in the ring, a retransmit may want it again
+    memcpy(dest, slot.data.constData(), slot.size);
+    *size = slot.size;
+
+    return true;
+}
+
+void TFTPReadAhead::Prefetch(const QSharedPointer<TFTPReadAhead> &self,
+                             qint64 offset)
+{
+    QVector<int> wanted;
+
+    {
+        QMutexLocker locker(&self->lock);
+
+        int depth = self->ring.size();
+
+        for (int i = 0; i < depth; ++i)
+        {
+            qint64 blockOffset = offset + (qint64)i * self->blockSize;
+
+            // The block at exactly the end of the file is empty
+            // but still exists
+            if (blockOffset > self->fileSize)
+                break;
+
+            int index = (blockOffset / self->blockSize) % depth;
+            Slot &slot = self->ring[index];
+
+            if (slot.offset == blockOffset && slot.state != EMPTY)
+                continue;
+
+            // Owned by a read in flight, can't be reused yet
+            if (slot.state == LOADING)
+                continue;
+
+            slot.offset = blockOffset;
+            slot.state = LOADING;
+            wanted.append(index);
+        }
+    }
+
+    // One task reads the whole run sequentially
+    if (!wanted.isEmpty())
+        QThreadPool::globalInstance()->start(new ReadTask(self, wanted));
+}
+
+void TFTPReadAhead::Load(const QVector<int> &slotIndices)
+{
+    for (int i = 0; i < slotIndices.size(); ++i)
+    {
+        // A LOADING slot belongs to this task, read without the lock
+        Slot &slot = ring[slotIndices[i]];
+
+        qint64 size = 0;
+
+#ifdef Q_OS_UNIX
+        size = pread(fd, slot.data.data(), blockSize, slot.offset);
+#endif
+
+        QMutexLocker locker(&lock);
+
+        if (size < 0)
+        {
+            // Let the transfer fall back to a synchronous read
+            slot.state = EMPTY;
+            slot.offset = -1;
+            continue;
+        }
+
+        slot.size = size;
+        slot.state = READY;
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPREADAHEAD_H
+#define TFTPREADAHEAD_H
+
+#include <QByteArray>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QVector>
+
+// Ring of upcoming blocks of a file, read on a background I/O pool
+// so a cold read never stalls the event loop. The ring is shared
+// with the reads in flight, it outlives a transfer that finishes
+// while a read is still running
+class TFTPReadAhead
+{
+    enum SlotState
+    {
+        EMPTY,
+        LOADING,
+        READY
+    };
+
+    struct Slot
+    {
+        qint64 offset;
+        SlotState state;
+        QByteArray data;
+        qint64 size;
+    };
+
+    class ReadTask;
+
+    QMutex lock;
+    QVector<Slot> ring;
+
+    // Private duplicate of the transfer's descriptor
+    int fd;
+    int blockSize;
+    qint64 fileSize;
+
+    TFTPReadAhead(int fd, int blockSize, qint64 fileSize, int depth);
+
+    void Load(const QVector<int> &slotIndices);
+
+public:
+    ~TFTPReadAhead();
+
+    // Returns null if the descriptor can't be duplicated
+    static QSharedPointer<TFTPReadAhead> Create(
+            int fd, int blockSize, qint64 fileSize, int depth);
+
+    // Copies the block at offset into dest if it has been read
+    bool Take(qint64 offset, char *dest, qint64 *size);
+
+    // Start reading blocks from offset onward that are not in the ring
+    static void Prefetch(const QSharedPointer<TFTPReadAhead> &self,
+                         qint64 offset);
+};
+
+#endif // TFTPREADAHEAD_H
@@ -0,0 +1,136 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftprequest.h"
+
+#include <QByteArray>
+
+#include <string.h>
+
+namespace
+{
+    struct OptionName
+    {
+        const char *name;
+        int length;
+    };
+
+    // Same order as TFTPRequest::Option
+    const OptionName optionNames[TFTPRequest::OPTIONCOUNT] =
+    {
+        { "blksize", 7 },
+        { "tsize", 5 },
+        { "timeout", 7 },
+        { "windowsize", 10 },
+        { "multicast", 9 },
+        { "rollover", 8 }
+    };
+
+    // Option names are case insensitive, RFC 2347
+    int LookupOptionName(const char *name, int length)
+    {
+        for (int i = 0; i < TFTPRequest::OPTIONCOUNT; ++i)
+        {
+            if (optionNames[i].length == length &&
+                    !qstrnicmp(name, optionNames[i].name, length))
+                return i;
+        }
+        return -1;
+    }
+}
+
+TFTPRequest::TFTPRequest()
+    : opcode(0)
+    , filename(nullptr)
+    , mode(nullptr)
+{
+    for (int i = 0; i < OPTIONCOUNT; ++i)
+        options[i] = nullptr;
+}
+
+const char *TFTPRequest::Parse(const char *data, int size)
+{
+    // Opcode, and at least an empty filename and mode
+    if (size < 4)
+        return "too small";
+
+    // Every string must be terminated, the last one by the last byte
+    if (data[size - 1] != 0)
+        return "unterminated string";
+
+    opcode = (quint8(data[0]) << 8) | quint8(data[1]);
+
+    const char *end = data + size;
+    const char *name = nullptr;
+    int nameLength = 0;
+    int index = 0;
+
+    for (const char *p = data + sizeof(quint16); p < end; ++index)
+    {
+        const char *nul = (const char*)memchr(p, 0, end - p);
+        int length = nul - p;
+
+        if (index == 0)
+        {
+            filename = p;
+        }
+        else if (index == 1)
+        {
+            mode = p;
+        }
+        else if ((index & 1) == 0)
+        {
+            name = p;
+            nameLength = length;
+        }
+        else
+        {
+            // The first occurrence of an option wins
+            int option = LookupOptionName(name, nameLength);
+            if (option >= 0 && !options[option])
+                options[option] = p;
+        }
+
+        p = nul + 1;
+    }
+
+    // Filename and mode fields are required
+    if (index < 2)
+        return "required filename and mode missing";
+
+    if (!*filename)
+        return "empty filename";
+
+    return nullptr;
+}
+
+const char *TFTPRequest::Value(Option option) const
+{
+    return options[option];
+}
+
+void TFTPRequest::Rebase(const char *from, const char *to)
+{
+    if (filename)
+        filename = to + (filename - from);
+    if (mode)
+        mode = to + (mode - from);
+
+    for (int i = 0; i < OPTIONCOUNT; ++i)
+    {
+        if (options[i])
+            options[i] = to + (options[i] - from);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPREQUEST_H
+#define TFTPREQUEST_H
+
+#include <QtGlobal>
+
+// A read or write request decoded in place, in one pass. The strings
+// point into the datagram, nothing is copied or allocated, so it is
+// only valid as long as the datagram is
+struct TFTPRequest
+{
+    // RFC 2347 options understood by the server. Anything else is
+    // ignored, as the RFC requires
+    enum Option
+    {
+        BLKSIZE,
+        TSIZE,
+        TIMEOUT,
+        WINDOWSIZE,
+        MULTICAST,
+        ROLLOVER,
+        OPTIONCOUNT
+    };
+
+    quint16 opcode;
+    const char *filename;
+    const char *mode;
+
+    // Value of each option, null if it was not requested
+    const char *options[OPTIONCOUNT];
+
+    TFTPRequest();
+
+    // Returns null on success, otherwise what is wrong with the packet
+    const char *Parse(const char *data, int size);
+
+    const char *Value(Option option) const;
+
+    // The datagram was copied from "from" to "to"
+    void Rebase(const char *from, const char *to);
+};
+
+#endif // TFTPREQUEST_H
@@ -0,0 +1,87 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftpsendscheduler.h"
+#include "tftptransfer.h"
+
+#include <algorithm>
+
+namespace
+{
+    bool LessRemaining(const TFTPTransfer *lhs, const TFTPTransfer *rhs)
+    {
+        return lhs->Remaining() < rhs->Remaining();
+    }
+}
+
+TFTPSendScheduler::TFTPSendScheduler(bool shortestFirst, QObject *parent)
+    : QObject(parent)
+    , runScheduled(false)
+    , shortestFirst(shortestFirst)
+{
+}
+
+TFTPSendScheduler::~TFTPSendScheduler()
+{
+    // At shutdown the transfers may be deleted after us
+    for (int i = 0; i < active.size(); ++i)
+        active[i]->DetachScheduler();
+}
+
+void TFTPSendScheduler::Schedule(TFTPTransfer *transfer)
+{
+    // The transfer only asks while it is not already waiting
+    active.append(transfer);
+
+    if (runScheduled)
+        return;
+
+    // Everything that wants to send by the time the event loop comes
+    // back around competes in the same round
+    runScheduled = true;
+    QMetaObject::invokeMethod(this, "Run", Qt::QueuedConnection);
+}
+
+void TFTPSendScheduler::Remove(TFTPTransfer *transfer)
+{
+    active.removeOne(transfer);
+}
+
+void TFTPSendScheduler::Run()
+{
+    runScheduled = false;
+
+    for (int round = 0; round < maxRounds && !active.isEmpty(); ++round)
+    {
+        if (shortestFirst)
+            std::stable_sort(active.begin(), active.end(), LessRemaining);
+
+        for (int i = 0; i < active.size(); )
+        {
+            // Done with its window, or waiting for tokens
+            if (!active[i]->SendQuantum(quantum))
+                active.removeAt(i);
+            else
+                ++i;
+        }
+    }
+
+    // Still more to send, after whatever else is waiting
+    if (!active.isEmpty() && !runScheduled)
+    {
+        runScheduled = true;
+        QMetaObject::invokeMethod(this, "Run", Qt::QueuedConnection);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPSENDSCHEDULER_H
+#define TFTPSENDSCHEDULER_H
+
+#include <QObject>
+#include <QList>
+
+class TFTPTransfer;
+
+// Shares the sending of DATA between the transfers of one thread.
+// Transfers with a window to send are served in deficit round robin
+// order, a quantum of bytes each per round, so a large transfer
+// can't hold up the small ones that other clients need to boot
+class TFTPSendScheduler : public QObject
+{
+    Q_OBJECT
+
+    QList<TFTPTransfer*> active;
+    bool runScheduled;
+
+    // Serve the transfers with the least left to send first
+    bool shortestFirst;
+
+public:
+    explicit TFTPSendScheduler(bool shortestFirst, QObject *parent = 0);
+    ~TFTPSendScheduler();
+
+    // Bytes each transfer may send per round
+    static const int quantum = 16384;
+
+    // Rounds per event loop pass, so ACKs are not held up
+    static const int maxRounds = 16;
+
+    // The transfer has blocks to send, SendQuantum is called until
+    // it returns false
+    void Schedule(TFTPTransfer *transfer);
+    void Remove(TFTPTransfer *transfer);
+
+private slots:
+    void Run();
+};
+
+#endif // TFTPSENDSCHEDULER_H
@@ -15,135 +15,601 @@
 
 #include "tftpserver.h"
 #include "tftptransfer.h"
+#include "tftpmultiplexer.h"
+#include "tftpmulticast.h"
+#include "tftptimerwheel.h"
+#include "tftpsendscheduler.h"
+#include "tftppathindex.h"
 
 #include <QDir>
 
+const int TFTPServer::minBlockSize;
+const int TFTPServer::maxBlockSize;
+
 TFTPServer::TFTPServer(const QString &serverRoot, QObject *parent)
     : QObject(parent)
+    , listener(nullptr)
+    , port(69)
+    , recvBatch(16, 1500)
     , serverRoot(serverRoot)
+    , index(new TFTPPathIndex(serverRoot, this))
+    , workerCount(QThread::idealThreadCount())
+    , nextWorker(0)
+    , multiplexed(false)
+    , maxIdleTime(TFTPTransfer::defaultMaxIdleTime)
+    , maxSessions(0)
+    , maxClientSessions(defaultMaxClientSessions)
+    , shortestFirst(false)
+    , verbose(false)
+    , mapFiles(true)
+    , multicastPort(1758)
+    , nextMulticastGroup(0)
 {
     // Assume failed so we can just return early on failure
     failed = true;
 }
 
+TFTPServer::~TFTPServer()
+{
+    // Transfers still running are deleted as their thread finishes
+    for (int i = 0; i < workers.size(); ++i)
+        workers[i]->quit();
+
+    for (int i = 0; i < workers.size(); ++i)
+    {
+        workers[i]->wait();
+        delete workers[i];
+    }
+
+    // Transfers on this thread, before the wheel and the session
+    // table they refer to go away
+    qDeleteAll(findChildren<TFTPTransfer*>());
+}
+
+void TFTPServer::SetPort(quint16 listenPort)
+{
+    port = listenPort;
+}
+
+quint16 TFTPServer::Port() const
+{
+    return listener ? listener->localPort() : port;
+}
+
+void TFTPServer::SetWorkerCount(int count)
+{
+    workerCount = count;
+}
+
+void TFTPServer::SetMultiplexed(bool enable)
+{
+    multiplexed = enable;
+}
+
+void TFTPServer::SetMaxSessions(int total, int perClient)
+{
+    maxSessions = total;
+    maxClientSessions = perClient;
+}
+
+void TFTPServer::SetRateLimit(qint64 total, qint64 perClient)
+{
+    limiter.SetGlobalRate(total);
+    limiter.SetClientRate(perClient);
+}
+
+void TFTPServer::SetShortestFirst(bool enable)
+{
+    shortestFirst = enable;
+}
+
+void TFTPServer::SetVerbose(bool enable)
+{
+    verbose = enable;
+}
+
+void TFTPServer::SetMapFiles(bool enable)
+{
+    mapFiles = enable;
+}
+
+void TFTPServer::SetPoolSize(int count)
+{
+    pool.SetCapacity(count);
+}
+
+void TFTPServer::SetMaxIdleTime(int ms)
+{
+    maxIdleTime = ms;
+}
+
+void TFTPServer::SetMulticast(const QHostAddress &baseGroup, quint16 port)
+{
+    multicastBase = baseGroup;
+    multicastPort = port;
+}
+
 void TFTPServer::init()
 {
     listener = new QUdpSocket(this);
     if (!listener)
         return;
 
-    if (!listener->bind(69))
+    if (!listener->bind(port))
         return;
 
+    // Multicast sessions send out the interface the request came in on
+    if (!UdpRecvBatch::EnablePacketInfo(listener) && !multicastBase.isNull())
+        emit warningEvent("TFTP: No IP_PKTINFO, multicast goes out the"
+                          " default interface");
+
     if (!connect(listener, SIGNAL(readyRead()), this, SLOT(OnPacketReceived())))
         return;
 
-    readBuffer.resize(576);
+    for (int i = 0; i < workerCount; ++i)
+    {
+        QThread *worker = new QThread;
+        worker->setObjectName(QString("TFTP worker %1").arg(i));
+        worker->start();
+        workers.append(worker);
+    }
+
+    DiscoverInterfaces();
+
+    // One timer wheel and send scheduler per thread that runs
+    // transfers
+    for (int i = 0; i < qMax(1, workers.size()); ++i)
+    {
+        TFTPTimerWheel *wheel;
+        wheel = new TFTPTimerWheel(workers.isEmpty() ? this : nullptr);
+
+        TFTPSendScheduler *scheduler;
+        scheduler = new TFTPSendScheduler(shortestFirst,
+                                          workers.isEmpty() ? this : nullptr);
+
+        if (!workers.isEmpty())
+        {
+            wheel->moveToThread(workers[i]);
+            connect(workers[i], SIGNAL(finished()),
+                    wheel, SLOT(deleteLater()));
+
+            scheduler->moveToThread(workers[i]);
+            connect(workers[i], SIGNAL(finished()),
+                    scheduler, SLOT(deleteLater()));
+        }
+
+        wheels.append(wheel);
+        schedulers.append(scheduler);
+    }
+
+    emit verboseEvent(QString("TFTP: Started %1 worker thread(s)")
+                      .arg(workers.size()));
+
+    if (multiplexed)
+    {
+        int count = qMax(1, workers.size());
+
+        for (int i = 0; i < count; ++i)
+        {
+            TFTPMultiplexer *mux;
+            mux = new TFTPMultiplexer(workers.isEmpty() ? this : nullptr);
+
+            connect(mux, SIGNAL(verboseEvent(QString)),
+                    this, SIGNAL(verboseEvent(QString)));
+            connect(mux, SIGNAL(errorEvent(QString)),
+                    this, SIGNAL(errorEvent(QString)));
+
+            if (!workers.isEmpty())
+            {
+                mux->moveToThread(workers[i]);
+                connect(workers[i], SIGNAL(finished()),
+                        mux, SLOT(deleteLater()));
+            }
+
+            // Queued ahead of any transfer start on the same thread
+            QMetaObject::invokeMethod(mux, "Open", Qt::QueuedConnection);
+
+            multiplexers.append(mux);
+        }
+    }
+
+    // Transfers ready to go before the first request arrives
+    int preallocate = pool.Capacity();
+    for (int i = 0; i < preallocate; ++i)
+    {
+        TFTPTransfer *transfer = NewTransfer(i % wheels.size());
+        if (!pool.Put(transfer))
+        {
+            delete transfer;
+            break;
+        }
+    }
+
+    emit verboseEvent(QString("TFTP: %1 transfer(s) preallocated")
+                      .arg(pool.Idle()));
 
     failed = false;
 }
 
-void TFTPServer::OnPacketReceived()
+void TFTPServer::DiscoverInterfaces()
 {
-    QHostAddress addr;
-    quint16 port;
+    subnets.clear();
 
-    while (listener->hasPendingDatagrams())
+    QList<QNetworkInterface> interfaces = QNetworkInterface::allInterfaces();
+
+    for (int i = 0; i < interfaces.size(); ++i)
     {
-        int size = listener->pendingDatagramSize();
+        const QNetworkInterface &interface = interfaces[i];
 
-        if (readBuffer.size() < size)
-            readBuffer.resize(size);
+        int mtu = interface.maximumTransmissionUnit();
+        if (mtu <= 0)
+            continue;
 
-        size = listener->readDatagram(readBuffer.data(), readBuffer.size(),
-            &addr, &port);
+        QList<QNetworkAddressEntry> entries = interface.addressEntries();
+        for (int j = 0; j < entries.size(); ++j)
+        {
+            Subnet subnet;
+            subnet.addr = entries[j].ip();
+            subnet.prefixLength = entries[j].prefixLength();
+            subnet.mtu = mtu;
+            subnets.append(subnet);
 
-        ParseListenerDatagram(size, addr, port);
+            emit verboseEvent(QString("TFTP: %1/%2 MTU %3")
+                              .arg(subnet.addr.toString())
+                              .arg(subnet.prefixLength)
+                              .arg(mtu));
+        }
     }
 }
 
-void TFTPServer::ParseListenerDatagram(
-        int size, QHostAddress &addr, quint16 port)
+quint16 TFTPServer::MaxBlockSize(const QHostAddress &client) const
 {
-    emit verboseEvent("TFTP: Parsing listener packet");
+    // Assume plain Ethernet for clients that are not on a local subnet
+    int mtu = 1500;
 
-    // Check for size being too small to be possibly valid
-    if (size < 6)
+    for (int i = 0; i < subnets.size(); ++i)
     {
-        emit errorEvent("Invalid TFTP request packet (too small)");
+        if (subnets[i].addr.protocol() == client.protocol() &&
+                client.isInSubnet(subnets[i].addr, subnets[i].prefixLength))
+        {
+            mtu = subnets[i].mtu;
+            break;
+        }
+    }
+
+    // IP, UDP and TFTP DATA headers
+    int headers = (client.protocol() == QAbstractSocket::IPv6Protocol ?
+                       40 : 20) + 8 + 4;
+
+    return (quint16)qBound(minBlockSize, mtu - headers, maxBlockSize);
+}
+
+void TFTPServer::SetCacheBudget(qint64 bytes)
+{
+    cache.SetBudget(bytes);
+}
+
+const TFTPFileCache &TFTPServer::Cache() const
+{
+    return cache;
+}
+
+const TFTPSessionTable &TFTPServer::Sessions() const
+{
+    return sessions;
+}
+
+const TFTPSessionPool &TFTPServer::Pool() const
+{
+    return pool;
+}
+
+TFTPPathIndex *TFTPServer::Index() const
+{
+    return index;
+}
+
+void TFTPServer::OnPacketReceived()
+{
+    int count;
+
+    while ((count = recvBatch.Receive(listener)) > 0)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (recvBatch.Size(i) < 0)
+            {
+                emit errorEvent("Invalid TFTP request packet (too large)");
+                continue;
+            }
+
+            ParseListenerDatagram(recvBatch.Data(i), recvBatch.Size(i),
+                                  recvBatch.Address(i), recvBatch.Port(i),
+                                  recvBatch.InterfaceIndex(i));
+        }
+    }
+}
+
+void TFTPServer::ParseListenerDatagram(const char *data, int size,
+        const QHostAddress &addr, quint16 port, int ifindex)
+{
+    // Decoded in place, the request points into the receive batch
+    TFTPRequest request;
+    const char *malformed = request.Parse(data, size);
+
+    if (malformed)
+    {
+        emit errorEvent(QString("Invalid TFTP request packet (%1)")
+                        .arg(malformed));
         return;
     }
 
-    // Big endian opcode
-    quint16 opcode;
-    opcode = (readBuffer[0] << 8) | readBuffer[1];
+    // ROMs often repeat the request before the reply arrives, let
+    // the transfer that already exists answer it
+    if (request.opcode == TFTPTransfer::RRQ &&
+            sessions.Absorb(addr, port, request.filename))
+    {
+        if (verbose)
+            emit verboseEvent(QString("TFTP: Duplicate request from %1:%2"
+                                      " absorbed (%3 so far)")
+                              .arg(addr.toString()).arg(port)
+                              .arg(sessions.Duplicates()));
+        return;
+    }
+
+    // Resolved from memory, most of what boot loaders probe for
+    // doesn't exist and is answered without touching the disk
+    QString filename;
 
-    // The request packet consists of a 16-bit big endian opcode
-    // followed by a number of null terminated strings
-    OptionOffsetList strings;
-    OptionOffsetList::value_type stringStart;
+    if (request.opcode == TFTPTransfer::RRQ &&
+            !index->Resolve(request.filename, &filename))
+    {
+        if (verbose)
+            emit verboseEvent(QString("TFTP: %1 not found (%2 of %3 lookups"
+                                      " cached)")
+                              .arg(request.filename).arg(index->Hits())
+                              .arg(index->Hits() + index->Misses()));
+        SendError(addr, port, TFTPTransfer::FILENOTFOUND, "File not found");
+        return;
+    }
 
-    stringStart = sizeof(quint16);
+    bool multicast = (request.opcode == TFTPTransfer::RRQ &&
+                      !multicastBase.isNull() &&
+                      request.Value(TFTPRequest::MULTICAST));
 
-    for (OptionOffsetList::value_type i = stringStart; i < size; ++i)
+    // A member repeating its request is already admitted, the
+    // session answers it again
+    if (multicast)
     {
-        if (readBuffer[i] == (char)0)
+        TFTPMulticastSession *session = multicastSessions.value(filename);
+
+        if (session && session->HasClient(addr, port))
         {
-            emit verboseEvent(QString("Option string: %1")
-                              .arg(readBuffer.constData() + stringStart));
-            strings.append(stringStart);
-            stringStart = i + 1;
+            session->AddClient(addr, port, request);
+            return;
         }
     }
 
-    // Filename and mode fields are required
-    if (strings.size() < 2)
+    // Admission control, a busy server or a client with too many
+    // transfers already is told so instead of starting another.
+    // Multicast members count like unicast transfers
+    if (request.opcode == TFTPTransfer::RRQ)
     {
-        emit errorEvent("Invalid TFTP request packet"
-                        " (required filename and mode missing)");
+        if (maxSessions > 0 &&
+                sessions.Active() + MulticastClients() >= maxSessions)
+        {
+            emit warningEvent(QString("TFTP: Refused %1:%2, %3 transfers"
+                                      " running")
+                              .arg(addr.toString()).arg(port)
+                              .arg(maxSessions));
+            SendError(addr, port, TFTPTransfer::NOTDEFINED, "Server busy");
+            return;
+        }
+
+        if (maxClientSessions > 0 &&
+                sessions.Active(addr) + MulticastClients(&addr) >=
+                maxClientSessions)
+        {
+            emit warningEvent(QString("TFTP: Refused %1:%2, client has %3"
+                                      " transfers running")
+                              .arg(addr.toString()).arg(port)
+                              .arg(maxClientSessions));
+            SendError(addr, port, TFTPTransfer::NOTDEFINED,
+                      "Too many transfers");
+            return;
+        }
+    }
+
+    // Clients that can share a multicast session join one, anything
+    // that can't be multicast falls through to a unicast transfer
+    if (multicast && StartMulticast(addr, port, filename, request, ifindex))
         return;
+
+    int worker = 0;
+    if (!workers.isEmpty())
+    {
+        worker = nextWorker;
+        nextWorker = (nextWorker + 1) % workers.size();
     }
 
-    // Parse filename, mode, and options
-    OptionList options;
-    options.append(OptionPair("filename", readBuffer.constData() +
-                              strings[0]));
-    options.append(OptionPair("mode", readBuffer.constData() +
-                              strings[1]));
+    TFTPTransfer *transfer;
 
-    // Iterate through optional extensions
-    for (int i = 2; i < strings.size() - 1; i += 2)
+    // Reuse a finished transfer on the same thread when there is one
+    transfer = pool.Acquire(workers.isEmpty() ? thread() : workers[worker]);
+
+    if (!transfer)
     {
-        options.append(OptionPair(readBuffer.constData() + strings[i],
-            readBuffer.constData() + strings[i+1]));
+        transfer = NewTransfer(worker);
+        pool.CountCreated();
     }
 
+    // The options point into the receive batch, which the next
+    // datagrams overwrite, so the transfer gets its own copy
+    transfer->SetRequest(addr, port, filename, data, size, request);
+    transfer->SetMaxBlockSize(MaxBlockSize(addr));
+    transfer->SetMaxIdleTime(maxIdleTime);
+    transfer->SetRateLimiter(&limiter);
+    transfer->SetVerbose(verbose);
+    transfer->SetMapFiles(mapFiles);
+
+    sessions.Insert(addr, port, request.filename, transfer,
+                    transfer->Generation());
+
+    if (verbose)
+        emit verboseEvent(QString("TFTP: Attempting to start transfer"
+                                  " (%1 active, high water %2, %3 reused)")
+                          .arg(pool.Active()).arg(pool.HighWater())
+                          .arg(pool.Reused()));
+
+    // Runs on the worker's event loop
+    QMetaObject::invokeMethod(transfer, "Start", Qt::QueuedConnection,
+                              Q_ARG(quint32, transfer->Generation()));
+}
+
+TFTPTransfer *TFTPServer::NewTransfer(int worker)
+{
+    TFTPMultiplexer *mux = nullptr;
+    if (!multiplexers.isEmpty())
+        mux = multiplexers[worker];
+
     TFTPTransfer *transfer;
-    transfer = new TFTPTransfer(this);
+    transfer = new TFTPTransfer(&cache, &sessions, &pool, mux,
+                                wheels[worker], schedulers[worker],
+                                workers.isEmpty() ? this : nullptr);
 
     connect(transfer, SIGNAL(verboseEvent(QString)), this,
             SLOT(OnTransferVerboseEvent(QString)));
     connect(transfer, SIGNAL(ErrorEvent(QString)), this,
             SLOT(OnTransferErrorEvent(QString)));
 
-    emit verboseEvent("TFTP: Attempting to start transfer");
+    if (!workers.isEmpty())
+    {
+        transfer->moveToThread(workers[worker]);
+
+        // Clean up transfers still running at shutdown
+        connect(workers[worker], SIGNAL(finished()),
+                transfer, SLOT(deleteLater()));
+    }
+
+    return transfer;
+}
+
+void TFTPServer::SendError(const QHostAddress &addr, quint16 port,
+                           quint16 code, const char *message)
+{
+    QByteArray packet;
+    packet.append((char)0);
+    packet.append((char)TFTPTransfer::ERROR);
+    packet.append((char)(code >> 8));
+    packet.append((char)code);
+    packet.append(message);
+    packet.append((char)0);
+
+    listener->writeDatagram(packet, addr, port);
+}
 
-    if (!transfer->StartTransfer(listener, addr, port,
-                                 opcode, serverRoot, options))
+bool TFTPServer::StartMulticast(const QHostAddress &addr, quint16 port,
+                                const QString &filename,
+                                const TFTPRequest &request, int ifindex)
+{
+    quint16 blockSize = 512;
+
+    const char *blockSizeOption = request.Value(TFTPRequest::BLKSIZE);
+    if (blockSizeOption)
     {
-        emit errorEvent("Transfer failed to start");
+        int requested = atoi(blockSizeOption);
+        if (requested < minBlockSize || requested > maxBlockSize)
+            return false;
+        blockSize = qMin((quint16)requested, MaxBlockSize(addr));
     }
+
+    TFTPMulticastSession *session = multicastSessions.value(filename);
+
+    if (!session)
+    {
+        QHostAddress group;
+
+        if (!AllocateMulticastGroup(&group))
+        {
+            emit warningEvent(QString("TFTP: No free multicast group"
+                                      " for %1, sending unicast")
+                              .arg(filename));
+            return false;
+        }
+
+        session = new TFTPMulticastSession(filename, blockSize,
+                                           group, multicastPort, this);
+        session->SetRateLimiter(&limiter);
+
+        connect(session, SIGNAL(verboseEvent(QString)), this,
+                SLOT(OnTransferVerboseEvent(QString)));
+        connect(session, SIGNAL(ErrorEvent(QString)), this,
+                SLOT(OnTransferErrorEvent(QString)));
+
+        if (!session->Open(&cache, ifindex))
+        {
+            emit verboseEvent(QString("TFTP: %1 can't be multicast")
+                              .arg(filename));
+            delete session;
+            return false;
+        }
+
+        connect(session, SIGNAL(finished(QString)), this,
+                SLOT(OnMulticastFinished(QString)));
+
+        multicastSessions.insert(filename, session);
+    }
+    else if (session->BlockSize() != blockSize)
+    {
+        // Every member receives the same DATA packets
+        return false;
+    }
+
+    session->AddClient(addr, port, request);
+
+    return true;
+}
+
+int TFTPServer::MulticastClients(const QHostAddress *addr) const
+{
+    int count = 0;
+
+    for (QHash<QString,TFTPMulticastSession*>::const_iterator
+         i = multicastSessions.constBegin(),
+         e = multicastSessions.constEnd(); i != e; ++i)
+        count += addr ? (*i)->Clients(*addr) : (*i)->Clients();
+
+    return count;
 }
 
-const char *TFTPServer::LookupOption(
-        const OptionList &options, const char *option)
+bool TFTPServer::AllocateMulticastGroup(QHostAddress *group)
 {
-    for (int i = 0; i < options.size(); ++i)
+    // Round robin from where the last one left off, so a group that
+    // was just given up isn't reused while stragglers still listen
+    for (int n = 0; n < multicastGroups; ++n)
     {
-        if (!strcmp(options[i].first, option))
-            return options[i].second;
+        QHostAddress candidate(multicastBase.toIPv4Address() +
+                               (nextMulticastGroup++ % multicastGroups));
+
+        bool held = false;
+        for (QHash<QString,TFTPMulticastSession*>::const_iterator
+             i = multicastSessions.constBegin(),
+             e = multicastSessions.constEnd(); i != e && !held; ++i)
+            held = ((*i)->GroupAddress() == candidate);
+
+        if (!held)
+        {
+            *group = candidate;
+            return true;
+        }
     }
-    return nullptr;
+
+    return false;
+}
+
+void TFTPServer::OnMulticastFinished(const QString &filename)
+{
+    multicastSessions.remove(filename);
 }
 
 void TFTPServer::OnTransferVerboseEvent(const QString &msg)
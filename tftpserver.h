@@ -19,33 +19,167 @@
 #include <QObject>
 #include <QSettings>
 #include <QUdpSocket>
-#include <QPair>
 #include <QList>
+#include <QHash>
+#include <QNetworkInterface>
+#include <QThread>
+
+#include "tftpfilecache.h"
+#include "udpbatch.h"
+#include "tftpsessiontable.h"
+#include "tftpsessionpool.h"
+#include "tftpratelimiter.h"
+#include "tftprequest.h"
+
+class TFTPMultiplexer;
+class TFTPMulticastSession;
+class TFTPTimerWheel;
+class TFTPSendScheduler;
+class TFTPPathIndex;
+class TFTPTransfer;
 
 class TFTPServer : public QObject
 {
     Q_OBJECT
 
     QUdpSocket *listener;
+    quint16 port;
     bool failed;
 
-    QByteArray readBuffer;
+    UdpRecvBatch recvBatch;
 
-    void ParseListenerDatagram(int size, QHostAddress &addr, quint16 port);
+    // The interface index is 0 when the kernel didn't say
+    void ParseListenerDatagram(const char *data, int size,
+            const QHostAddress &addr, quint16 port, int ifindex);
 
     QString serverRoot;
 
+    // Which requested names exist under serverRoot
+    TFTPPathIndex *index;
+
+    TFTPFileCache cache;
+
+    // Transfers are spread round robin over the workers.
+    // With no workers they run on the listener's thread
+    int workerCount;
+    QList<QThread*> workers;
+    int nextWorker;
+
+    // Optionally, one shared socket per worker carries all of
+    // that worker's transfers
+    bool multiplexed;
+    QList<TFTPMultiplexer*> multiplexers;
+
+    // Retransmission timeouts of each worker's transfers
+    QList<TFTPTimerWheel*> wheels;
+
+    // Share each worker's sending fairly between its transfers,
+    // optionally the ones closest to done first
+    QList<TFTPSendScheduler*> schedulers;
+
+    // Live unicast transfers, and how many were reaped
+    TFTPSessionTable sessions;
+    int maxIdleTime;
+
+    // Most transfers at once, in total and from one client address.
+    // 0 is unlimited
+    int maxSessions;
+    int maxClientSessions;
+
+    bool shortestFirst;
+
+    // Transfers report every packet, not just how they start and end
+    bool verbose;
+
+    bool mapFiles;
+
+    // DATA rate of all transfers, and of each client
+    TFTPRateLimiter limiter;
+
+    void SendError(const QHostAddress &addr, quint16 port,
+                   quint16 code, const char *message);
+
+    // Finished transfers kept for reuse
+    TFTPSessionPool pool;
+
+    // Created on, and moved to, the given worker
+    TFTPTransfer *NewTransfer(int worker);
+
+    // RFC 2090 sessions by translated filename. Groups are handed
+    // out from multicastBase onward, skipping any a running session
+    // holds. They run on this thread, there is only ever one per
+    // file being booted
+    QHostAddress multicastBase;
+    quint16 multicastPort;
+    quint32 nextMulticastGroup;
+    QHash<QString,TFTPMulticastSession*> multicastSessions;
+
+    // Local subnets and the MTU of the interface they are on, used to
+    // pick the largest block that fits in one unfragmented datagram
+    struct Subnet
+    {
+        QHostAddress addr;
+        int prefixLength;
+        int mtu;
+    };
+
+    QList<Subnet> subnets;
+
+    void DiscoverInterfaces();
 
 public:
     explicit TFTPServer(const QString &serverRoot, QObject *parent = 0);
+    ~TFTPServer();
     void init();
 
-    typedef QPair<const char *,const char *> OptionPair;
-    typedef QList<quint16> OptionOffsetList;
-    typedef QList<OptionPair> OptionList;
-    
-    static const char *LookupOption(
-            const OptionList &options, const char *option);
+    // 69 unless set before init. 0 picks a free port, which Port
+    // tells once init has bound it
+    void SetPort(quint16 listenPort);
+    quint16 Port() const;
+
+    void SetWorkerCount(int count);
+    void SetMultiplexed(bool enable);
+    void SetMaxIdleTime(int ms);
+    void SetPoolSize(int count);
+    void SetShortestFirst(bool enable);
+    void SetVerbose(bool enable);
+
+    // Files the cache doesn't hold are mapped unless disabled, then
+    // every block is read into a packet buffer
+    void SetMapFiles(bool enable);
+
+    // 0 is unlimited
+    void SetMaxSessions(int total, int perClient);
+    void SetRateLimit(qint64 total, qint64 perClient);
+
+    static const int defaultMaxClientSessions = 8;
+    void SetMulticast(const QHostAddress &baseGroup, quint16 port);
+
+    void SetCacheBudget(qint64 bytes);
+    const TFTPFileCache &Cache() const;
+    const TFTPSessionTable &Sessions() const;
+    const TFTPSessionPool &Pool() const;
+
+    // Exists even if init fails, the HTTP server shares it
+    TFTPPathIndex *Index() const;
+
+    // RFC 2348 limits
+    static const int minBlockSize = 8;
+    static const int maxBlockSize = 65464;
+
+    // Largest blksize that reaches the client without fragmentation
+    quint16 MaxBlockSize(const QHostAddress &client) const;
+
+private:
+    static const int multicastGroups = 256;
+
+    bool StartMulticast(const QHostAddress &addr, quint16 port,
+                        const QString &filename,
+                        const TFTPRequest &request, int ifindex);
+    bool AllocateMulticastGroup(QHostAddress *group);
+
+    // Members of every multicast session, or only those at addr
+    int MulticastClients(const QHostAddress *addr = nullptr) const;
 
 signals:
     void verboseEvent(const QString &msg);
@@ -56,6 +190,7 @@ public slots:
     void OnPacketReceived();
     void OnTransferVerboseEvent(const QString &msg);
     void OnTransferErrorEvent(const QString &msg);
+    void OnMulticastFinished(const QString &filename);
 };
 
 #endif // TFTPSERVER_H
@@ -0,0 +1,138 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftpsessionpool.h"
+#include "tftptransfer.h"
+
+#include <QMutexLocker>
+
+TFTPSessionPool::TFTPSessionPool()
+    : capacity(defaultCapacity)
+    , idleCount(0)
+    , active(0)
+    , highWater(0)
+    , created(0)
+    , reused(0)
+{
+}
+
+void TFTPSessionPool::SetCapacity(int count)
+{
+    QMutexLocker locker(&lock);
+    capacity = count;
+}
+
+int TFTPSessionPool::Capacity() const
+{
+    QMutexLocker locker(&lock);
+    return capacity;
+}
+
+void TFTPSessionPool::CountActive()
+{
+    ++active;
+    if (highWater < active)
+        highWater = active;
+}
+
+TFTPTransfer *TFTPSessionPool::Acquire(QThread *thread)
+{
+    QMutexLocker locker(&lock);
+
+    QHash<QThread*,TransferList>::iterator i = idle.find(thread);
+
+    if (i == idle.end() || i.value().isEmpty())
+        return nullptr;
+
+    // Most recently used first, its memory is most likely still hot
+    TFTPTransfer *transfer = i.value().takeLast();
+    --idleCount;
+
+    ++reused;
+    CountActive();
+
+    return transfer;
+}
+
+void TFTPSessionPool::CountCreated()
+{
+    QMutexLocker locker(&lock);
+
+    ++created;
+    CountActive();
+}
+
+bool TFTPSessionPool::Put(TFTPTransfer *transfer)
+{
+    QMutexLocker locker(&lock);
+
+    if (idleCount >= capacity)
+        return false;
+
+    idle[transfer->thread()].append(transfer);
+    ++idleCount;
+
+    return true;
+}
+
+bool TFTPSessionPool::Release(TFTPTransfer *transfer)
+{
+    {
+        QMutexLocker locker(&lock);
+        --active;
+    }
+
+    return Put(transfer);
+}
+
+void TFTPSessionPool::Forget(TFTPTransfer *transfer)
+{
+    QMutexLocker locker(&lock);
+
+    QHash<QThread*,TransferList>::iterator i = idle.find(transfer->thread());
+
+    if (i != idle.end() && i.value().removeOne(transfer))
+        --idleCount;
+}
+
+int TFTPSessionPool::Idle() const
+{
+    QMutexLocker locker(&lock);
+    return idleCount;
+}
+
+int TFTPSessionPool::Active() const
+{
+    QMutexLocker locker(&lock);
+    return active;
+}
+
+int TFTPSessionPool::HighWater() const
+{
+    QMutexLocker locker(&lock);
+    return highWater;
+}
+
+quint64 TFTPSessionPool::Created() const
+{
+    QMutexLocker locker(&lock);
+    return created;
+}
+
+quint64 TFTPSessionPool::Reused() const
+{
+    QMutexLocker locker(&lock);
+    return reused;
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPSESSIONPOOL_H
+#define TFTPSESSIONPOOL_H
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QThread>
+
+class TFTPTransfer;
+
+// Finished transfers are kept here, with their socket, file and
+// buffers, to serve the next request instead of being deleted. A
+// transfer belongs to the thread it was moved to, so it is only
+// ever reused on that thread
+class TFTPSessionPool
+{
+    typedef QList<TFTPTransfer*> TransferList;
+
+    mutable QMutex lock;
+    QHash<QThread*,TransferList> idle;
+
+    // Most idle transfers kept, across all threads
+    int capacity;
+    int idleCount;
+
+    int active;
+    int highWater;
+
+    quint64 created;
+    quint64 reused;
+
+    void CountActive();
+
+public:
+    TFTPSessionPool();
+
+    static const int defaultCapacity = 64;
+
+    void SetCapacity(int count);
+    int Capacity() const;
+
+    // An idle transfer on thread, or null if a new one is needed
+    TFTPTransfer *Acquire(QThread *thread);
+
+    // A new transfer was created instead
+    void CountCreated();
+
+    // Adds a transfer that was never used, returns false if full
+    bool Put(TFTPTransfer *transfer);
+
+    // A transfer finished. Returns false if the pool is full and it
+    // should be deleted
+    bool Release(TFTPTransfer *transfer);
+
+    // The transfer is being deleted
+    void Forget(TFTPTransfer *transfer);
+
+    int Idle() const;
+    int Active() const;
+    int HighWater() const;
+    quint64 Created() const;
+    quint64 Reused() const;
+};
+
+#endif // TFTPSESSIONPOOL_H
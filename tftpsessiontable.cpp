@@ -0,0 +1,132 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftpsessiontable.h"
+#include "tftptransfer.h"
+
+#include <QMutexLocker>
+
+bool TFTPSessionTable::Key::operator==(const Key &rhs) const
+{
+    return clientPort == rhs.clientPort && clientAddr == rhs.clientAddr;
+}
+
+uint qHash(const TFTPSessionTable::Key &key, uint seed)
+{
+    return qHash(key.clientAddr, seed) ^ key.clientPort;
+}
+
+TFTPSessionTable::TFTPSessionTable()
+    : started(0)
+    , duplicates(0)
+{
+    for (int i = 0; i <= REAPED; ++i)
+        outcomes[i] = 0;
+}
+
+void TFTPSessionTable::Insert(const QHostAddress &addr, quint16 port,
+                              const char *filename, TFTPTransfer *transfer,
+                              quint32 generation)
+{
+    QMutexLocker locker(&lock);
+
+    Key key = { addr, port };
+    Entry entry = { transfer, generation, QByteArray(filename) };
+
+    // A new request from the same port replaces the old entry. The
+    // client gave up on that transfer, which would otherwise keep
+    // sending to the port uncounted until it ran out of retries
+    SessionMap::const_iterator i = sessions.constFind(key);
+
+    if (i == sessions.constEnd())
+        ++perClient[addr];
+    else
+        QMetaObject::invokeMethod(i.value().transfer, "OnSuperseded",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(quint32, i.value().generation));
+
+    sessions.insert(key, entry);
+    ++started;
+}
+
+bool TFTPSessionTable::Absorb(const QHostAddress &addr, quint16 port,
+                              const char *filename)
+{
+    QMutexLocker locker(&lock);
+
+    Key key = { addr, port };
+    SessionMap::const_iterator i = sessions.constFind(key);
+
+    if (i == sessions.constEnd() || i.value().filename != filename)
+        return false;
+
+    // The transfer removes itself under the lock before it is
+    // deleted, so it is safe to post to while the lock is held
+    QMetaObject::invokeMethod(i.value().transfer, "OnDuplicateRequest",
+                              Qt::QueuedConnection,
+                              Q_ARG(quint32, i.value().generation));
+    ++duplicates;
+
+    return true;
+}
+
+void TFTPSessionTable::Remove(const QHostAddress &addr, quint16 port,
+                              TFTPTransfer *transfer, Outcome outcome)
+{
+    QMutexLocker locker(&lock);
+
+    Key key = { addr, port };
+    SessionMap::iterator i = sessions.find(key);
+
+    if (i != sessions.end() && i.value().transfer == transfer)
+    {
+        sessions.erase(i);
+
+        if (--perClient[addr] <= 0)
+            perClient.remove(addr);
+    }
+
+    ++outcomes[outcome];
+}
+
+int TFTPSessionTable::Active() const
+{
+    QMutexLocker locker(&lock);
+    return sessions.size();
+}
+
+int TFTPSessionTable::Active(const QHostAddress &addr) const
+{
+    QMutexLocker locker(&lock);
+    return perClient.value(addr);
+}
+
+quint64 TFTPSessionTable::Started() const
+{
+    QMutexLocker locker(&lock);
+    return started;
+}
+
+quint64 TFTPSessionTable::Duplicates() const
+{
+    QMutexLocker locker(&lock);
+    return duplicates;
+}
+
+quint64 TFTPSessionTable::Count(Outcome outcome) const
+{
+    QMutexLocker locker(&lock);
+    return outcomes[outcome];
+}
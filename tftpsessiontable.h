@@ -0,0 +1,103 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPSESSIONTABLE_H
+#define TFTPSESSIONTABLE_H
+
+#include <QHash>
+#include <QHostAddress>
+#include <QMutex>
+#include <QByteArray>
+
+class TFTPTransfer;
+
+// Every unicast transfer that exists, by client address and port,
+// and how the ones that are gone ended. Transfers are added by the
+// listener and remove themselves on whatever thread they run on
+class TFTPSessionTable
+{
+public:
+    enum Outcome
+    {
+        // Failed to start, client sent an ERROR, or shut down
+        ABORTED,
+
+        // Last block acknowledged
+        COMPLETED,
+
+        // Client stopped responding, ran out of retries or idle time
+        REAPED
+    };
+
+    struct Key
+    {
+        QHostAddress clientAddr;
+        quint16 clientPort;
+
+        bool operator==(const Key &rhs) const;
+    };
+
+private:
+    struct Entry
+    {
+        TFTPTransfer *transfer;
+        quint32 generation;
+
+        // As requested, not translated
+        QByteArray filename;
+    };
+
+    typedef QHash<Key,Entry> SessionMap;
+
+    mutable QMutex lock;
+    SessionMap sessions;
+
+    // Live transfers of each client address
+    QHash<QHostAddress,int> perClient;
+
+    quint64 started;
+    quint64 duplicates;
+    quint64 outcomes[REAPED + 1];
+
+public:
+    TFTPSessionTable();
+
+    // generation is the transfer's at the time, passed along with
+    // duplicates so a recycled transfer can tell them apart. A
+    // transfer already running for the same port is superseded
+    void Insert(const QHostAddress &addr, quint16 port,
+                const char *filename, TFTPTransfer *transfer,
+                quint32 generation);
+
+    // A retransmitted request for a transfer that is already running
+    // is handed to that transfer to answer. Returns false if there
+    // is no such transfer
+    bool Absorb(const QHostAddress &addr, quint16 port,
+                const char *filename);
+
+    // Only removes the entry if it is still this transfer's
+    void Remove(const QHostAddress &addr, quint16 port,
+                TFTPTransfer *transfer, Outcome outcome);
+
+    int Active() const;
+    int Active(const QHostAddress &addr) const;
+    quint64 Started() const;
+    quint64 Duplicates() const;
+    quint64 Count(Outcome outcome) const;
+};
+
+uint qHash(const TFTPSessionTable::Key &key, uint seed = 0);
+
+#endif // TFTPSESSIONTABLE_H
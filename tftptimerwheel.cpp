@@ -0,0 +1,206 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "tftptimerwheel.h"
+#include "tftptransfer.h"
+
+TFTPTimerWheel::Timer::Timer()
+    : prev(nullptr)
+    , next(nullptr)
+    , expires(0)
+    , owner(nullptr)
+{
+}
+
+bool TFTPTimerWheel::Timer::IsArmed() const
+{
+    return prev != nullptr;
+}
+
+TFTPTimerWheel::TFTPTimerWheel(QObject *parent)
+    : QObject(parent)
+    , tick(new QTimer(this))
+    , now(0)
+    , armed(0)
+    , expired(0)
+{
+    for (int i = 0; i < slotCount; ++i)
+    {
+        Init(&slots0[i]);
+        Init(&slots1[i]);
+    }
+
+    clock.start();
+
+    // Only ticks while something is armed
+    tick->setInterval(tickInterval);
+    connect(tick, SIGNAL(timeout()), this, SLOT(OnTick()));
+}
+
+TFTPTimerWheel::~TFTPTimerWheel()
+{
+    // At shutdown the transfers may be deleted after us, leave their
+    // timers disarmed so they don't touch the wheel. Transfers only
+    // call Cancel for a timer that is still armed
+    for (int i = 0; i < slotCount; ++i)
+    {
+        while (slots0[i].next != &slots0[i])
+            Unlink(slots0[i].next);
+        while (slots1[i].next != &slots1[i])
+            Unlink(slots1[i].next);
+    }
+}
+
+void TFTPTimerWheel::Init(Timer *list)
+{
+    list->prev = list;
+    list->next = list;
+}
+
+void TFTPTimerWheel::Link(Timer *list, Timer *timer)
+{
+    timer->prev = list->prev;
+    timer->next = list;
+    list->prev->next = timer;
+    list->prev = timer;
+}
+
+void TFTPTimerWheel::Unlink(Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = nullptr;
+    timer->next = nullptr;
+}
+
+quint64 TFTPTimerWheel::ElapsedTicks() const
+{
+    return (quint64)clock.elapsed() / tickInterval;
+}
+
+void TFTPTimerWheel::Place(Timer *timer)
+{
+    quint64 delta = timer->expires - now;
+
+    if (delta < (quint64)slotCount)
+        Link(&slots0[timer->expires & slotMask], timer);
+    else if (delta < (quint64)slotCount * slotCount)
+        Link(&slots1[(timer->expires >> slotBits) & slotMask], timer);
+    else
+    {
+        // Beyond the reach of level 1. Park it in the last slot that
+        // cascades, it is placed again from there
+        Link(&slots1[((now >> slotBits) + slotCount - 1) & slotMask],
+             timer);
+    }
+}
+
+void TFTPTimerWheel::Arm(Timer *timer, int ms)
+{
+    if (timer->IsArmed())
+        Unlink(timer);
+    else
+        ++armed;
+
+    if (!tick->isActive())
+    {
+        // Idle until now, catch up without expiring anything
+        now = ElapsedTicks();
+        tick->start();
+    }
+
+    // Round up, at least one tick
+    quint64 ticks = qMax(1, (ms + tickInterval - 1) / tickInterval);
+
+    timer->expires = now + ticks;
+    Place(timer);
+}
+
+void TFTPTimerWheel::Cancel(Timer *timer)
+{
+    if (!timer->IsArmed())
+        return;
+
+    Unlink(timer);
+    --armed;
+}
+
+void TFTPTimerWheel::Cascade()
+{
+    // Level 0 wrapped, the next level 1 slot is due within one round
+    Timer *list = &slots1[(now >> slotBits) & slotMask];
+
+    while (list->next != list)
+    {
+        Timer *timer = list->next;
+        Unlink(timer);
+        Place(timer);
+    }
+}
+
+void TFTPTimerWheel::OnTick()
+{
+    // Collect everything due first, then fire them as one batch.
+    // The event loop may have fallen several ticks behind
+    Timer due;
+    Init(&due);
+
+    quint64 target = ElapsedTicks();
+
+    while (now < target)
+    {
+        ++now;
+
+        if ((now & slotMask) == 0)
+            Cascade();
+
+        Timer *list = &slots0[now & slotMask];
+
+        if (list->next == list)
+            continue;
+
+        // Splice the whole slot onto the batch
+        due.prev->next = list->next;
+        list->next->prev = due.prev;
+        list->prev->next = &due;
+        due.prev = list->prev;
+        Init(list);
+    }
+
+    // A handler may arm or cancel any timer, including others in
+    // the batch, so take them off one at a time
+    while (due.next != &due)
+    {
+        Timer *timer = due.next;
+        Unlink(timer);
+        --armed;
+        ++expired;
+
+        timer->owner->OnTimer(timer);
+    }
+
+    if (armed == 0)
+        tick->stop();
+}
+
+int TFTPTimerWheel::Armed() const
+{
+    return armed;
+}
+
+quint64 TFTPTimerWheel::Expired() const
+{
+    return expired;
+}
@@ -0,0 +1,96 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef TFTPTIMERWHEEL_H
+#define TFTPTIMERWHEEL_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+class TFTPTransfer;
+
+// Timeouts of every transfer on one thread, driven by a single
+// periodic tick. Two levels of slots, a timer is a node in the list
+// of the slot it expires in, so arming, cancelling and expiring are
+// all constant time however many transfers are running
+class TFTPTimerWheel : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Embedded in its owner, the wheel never allocates
+    struct Timer
+    {
+        Timer *prev;
+        Timer *next;
+
+        // Tick it expires on
+        quint64 expires;
+
+        TFTPTransfer *owner;
+
+        Timer();
+
+        bool IsArmed() const;
+    };
+
+    // Resolution of every timeout
+    static const int tickInterval = 10;
+
+private:
+    static const int slotBits = 8;
+    static const int slotCount = 1 << slotBits;
+    static const int slotMask = slotCount - 1;
+
+    // Level 0 holds the next slotCount ticks, level 1 the next
+    // slotCount rounds of level 0. Each slot is the sentinel of a
+    // circular list
+    Timer slots0[slotCount];
+    Timer slots1[slotCount];
+
+    QTimer *tick;
+    QElapsedTimer clock;
+
+    // Last tick processed
+    quint64 now;
+
+    int armed;
+    quint64 expired;
+
+    quint64 ElapsedTicks() const;
+    void Place(Timer *timer);
+    void Cascade();
+
+    static void Init(Timer *list);
+    static void Link(Timer *list, Timer *timer);
+    static void Unlink(Timer *timer);
+
+public:
+    explicit TFTPTimerWheel(QObject *parent = 0);
+    ~TFTPTimerWheel();
+
+    // (Re)arm timer to expire in ms milliseconds
+    void Arm(Timer *timer, int ms);
+    void Cancel(Timer *timer);
+
+    int Armed() const;
+    quint64 Expired() const;
+
+public slots:
+    void OnTick();
+};
+
+#endif // TFTPTIMERWHEEL_H
@@ -14,29 +14,94 @@
  */
 
 #include "tftptransfer.h"
+#include "tftpmultiplexer.h"
+#include "udpbatch.h"
 
 #include <QFile>
 #include <QFileInfo>
 #include <QtEndian>
 
-// DATA and ACK packets start with this structure
-// Error packets do too, except "block" holds the error code
-struct BlockHeader
-{
-    quint16 opcode;
-    quint16 block;
-};
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+const int TFTPTransfer::minRetransmitInterval;
 
-TFTPTransfer::TFTPTransfer(QObject *parent)
+TFTPTransfer::TFTPTransfer(TFTPFileCache *cache, TFTPSessionTable *sessions,
+                           TFTPSessionPool *pool, TFTPMultiplexer *mux,
+                           TFTPTimerWheel *wheel, TFTPSendScheduler *scheduler,
+                           QObject *parent)
     : QObject(parent)
+    , file(nullptr)
     , sock(nullptr)
+    , mux(mux)
+    , registered(false)
+    , recvBatch(nullptr)
+    , batch(nullptr)
+    , cache(cache)
+    , sessions(sessions)
+    , listed(false)
+    , outcome(TFTPSessionTable::ABORTED)
+    , pool(pool)
+    , generation(0)
+    , limiter(nullptr)
+    , prepaid(false)
+    , sendBlock(0)
+    , sendOffset(0)
+    , sendRemaining(0)
+    , scheduler(scheduler)
+    , scheduled(false)
+    , deficit(0)
+    , source(nullptr)
+    , mapped(false)
+    , advisedOffset(0)
+    , mapFiles(true)
     , blockSize(512)
-    , retransmitTimer(new QTimer(this))
-    , retransmitInterval(1000)
+    , windowSize(1)
+    , maxBlockSize(TFTPServer::maxBlockSize)
+    , blockOffset(0)
+    , fileSize(0)
+    , rolloverBase(0)
+    , wheel(wheel)
+    , retransmitInterval(initialRetransmitInterval)
+    , smoothedRtt(-1)
+    , rttVariance(0)
+    , maxRetransmitInterval(defaultMaxRetransmitInterval)
+    , retries(0)
+    , windowRetransmitted(false)
+    , maxIdleTime(defaultMaxIdleTime)
+    , verbose(false)
+{
+    retransmitTimer.owner = this;
+    idleTimer.owner = this;
+    paceTimer.owner = this;
+}
+
+TFTPTransfer::~TFTPTransfer()
 {
-    retransmitTimer->setSingleShot(true);
-    connect(retransmitTimer, SIGNAL(timeout()), 
-            this, SLOT(OnRetransmitTimer()));
+    // Deleted without finishing, e.g. at shutdown
+    if (registered)
+        mux->Unregister(clientAddr, clientPort, this);
+
+    // The wheel may be gone already at thread exit. It disarms every
+    // timer when it is deleted, so only an armed one means it is not
+    if (retransmitTimer.IsArmed())
+        wheel->Cancel(&retransmitTimer);
+    if (idleTimer.IsArmed())
+        wheel->Cancel(&idleTimer);
+    if (paceTimer.IsArmed())
+        wheel->Cancel(&paceTimer);
+
+    if (scheduled)
+        scheduler->Remove(this);
+
+    if (listed)
+        sessions->Remove(clientAddr, clientPort, this, outcome);
+
+    pool->Forget(this);
+
+    delete recvBatch;
 }
 
 void TFTPTransfer::SendErrorPacket(QUdpSocket *target,
@@ -64,72 +129,143 @@ void TFTPTransfer::SendErrorFileNotFound(QUdpSocket *target,
     SendErrorPacket(target, addr, port, FILENOTFOUND, "File not found");
 }
 
-QString TFTPTransfer::TranslateFilename(
-        const QString &serverRoot, const char *filename)
+void TFTPTransfer::SetRequest(const QHostAddress &addr, quint16 port,
+    const QString &filename, const char *packet, int size,
+    const TFTPRequest &options)
 {
-    QString result(filename);
-    result = result.replace(QChar('\\'), QChar('/'));
+    clientAddr = addr;
+    clientPort = port;
+    requestPath = filename;
 
-    if (result.contains("/..") || result.contains("../"))
-        return "";
+    // Deep copy, then rebase the option pointers into the copy
+    requestPacket = QByteArray(packet, size);
 
-    if (result[0] != '/')
-        result = serverRoot + '/' + result;
-    else
-        result = serverRoot + result;
+    request = options;
+    request.Rebase(packet, requestPacket.constData());
+
+    // The listener adds us to the session table next
+    listed = true;
+}
+
+void TFTPTransfer::SetMaxBlockSize(quint16 size)
+{
+    maxBlockSize = size;
+}
+
+void TFTPTransfer::SetRateLimiter(TFTPRateLimiter *rateLimiter)
+{
+    limiter = rateLimiter;
+}
+
+void TFTPTransfer::SetVerbose(bool enable)
+{
+    verbose = enable;
+}
+
+void TFTPTransfer::SetMapFiles(bool enable)
+{
+    mapFiles = enable;
+}
+
+quint32 TFTPTransfer::Generation() const
+{
+    return generation;
+}
 
-    return result;
+void TFTPTransfer::SetMaxIdleTime(int ms)
+{
+    maxIdleTime = ms;
+}
+
+void TFTPTransfer::Start(quint32 requestGeneration)
+{
+    if (requestGeneration != generation)
+        return;
+
+    // Failures are reported, and the transfer finished, inside.
+    // Nothing may touch this after that
+    StartTransfer(nullptr, clientAddr, clientPort, requestPath, request);
 }
 
 bool TFTPTransfer::StartTransfer(QUdpSocket *,
     const QHostAddress &addr, quint16 port,
-    quint16 opcode, const QString &serverRoot,
-    const TFTPServer::OptionList &options)
+    const QString &filename, const TFTPRequest &options)
 {
-    sock = new QUdpSocket(this);
+    if (mux)
+    {
+        // Replies come back through the multiplexer once registered
+        sock = mux->Socket();
+        batch = mux->SendBatch();
 
-    connect(sock, SIGNAL(readyRead()), this, SLOT(OnPacketReceived()));
+        if (!sock)
+        {
+            emit ErrorEvent("Multiplexed socket not open!");
+            Finish();
+            return false;
+        }
+
+        // A transfer the client gave up on is superseded by the
+        // session table before we are started, and unregisters
+        if (!mux->Register(addr, port, this))
+        {
+            emit ErrorEvent(QString("%1:%2 already has a transfer")
+                            .arg(addr.toString()).arg(port));
+            Finish();
+            return false;
+        }
 
-    if (!sock->bind(0))
+        registered = true;
+    }
+    else
     {
-        emit ErrorEvent("bind(0) failed!");
-        deleteLater();
-        return false;
+        // A recycled transfer keeps its socket, bound to a new port
+        if (!sock)
+        {
+            sock = new QUdpSocket(this);
+
+            connect(sock, SIGNAL(readyRead()),
+                    this, SLOT(OnPacketReceived()));
+
+            // Only ever ACKs or an ERROR from one client
+            recvBatch = new UdpRecvBatch(4, maxControlPacket);
+
+            ownBatch.SetSocket(sock);
+        }
+
+        batch = &ownBatch;
+
+        if (!sock->bind(0))
+        {
+            emit ErrorEvent("bind(0) failed!");
+            Finish();
+            return false;
+        }
     }
 
-    if (opcode != RRQ)
+    if (options.opcode != RRQ)
     {
         emit ErrorEvent("opcode is not RRQ!");
         SendErrorPacket(sock, addr, port,
                         ILLEGALOPERATION, "Unsupported operation");
-        deleteLater();
+        Finish();
         return false;
     }
 
-    const char *requestFilename;
-    requestFilename = options[0].second;
-
     // mode is ignored
     //const char *mode;
-    //mode = options[1].second;
-
-    QString filename;
-    filename = TranslateFilename(serverRoot, requestFilename);
+    //mode = options.mode;
 
-    file = new QFile(filename, this);
     if (!file)
-    {
-        emit ErrorEvent("Out of memory");
-        deleteLater();
-        return false;
-    }
+        file = new QFile(filename, this);
+    else
+        file->setFileName(filename);
 
     if (!file->open(QFile::ReadOnly))
     {
         emit ErrorEvent(QString("File %1 not found: %2")
             .arg(filename).arg(file->errorString()));
         SendErrorFileNotFound(sock, addr, port);
-        deleteLater();
+        Finish();
         return false;
     }
 
@@ -139,23 +275,25 @@ bool TFTPTransfer::StartTransfer(QUdpSocket *,
     if ((file->permissions() & QFile::ReadOther) == 0)
     {
         SendErrorPacket(sock, addr, port, ACCESSVIOLATION, "Permission denied");
-        deleteLater();
+        Finish();
         return false;
     }
 
     // Prepare OACK
-    QByteArray oack;
+    oack.clear();
     oack.append((char)0);
     oack.append((char)OACK);
 
-    const char *tsizeOption = TFTPServer::LookupOption(options, "tsize");
+    const char *tsizeOption = options.Value(TFTPRequest::TSIZE);
 
     if (tsizeOption)
     {
         qint64 fileSize;
         fileSize = file->size();
 
-        emit verboseEvent(QString("Response file size=%1").arg(fileSize));
+        if (verbose)
+            emit verboseEvent(QString("Response file size=%1")
+                              .arg(fileSize));
 
         oack.append(u8"tsize");
         oack.append((char)0);
@@ -163,13 +301,22 @@ bool TFTPTransfer::StartTransfer(QUdpSocket *,
         oack.append((char)0);
     }
 
-    const char *blockSizeOption = TFTPServer::LookupOption(options, "blksize");
+    const char *blockSizeOption = options.Value(TFTPRequest::BLKSIZE);
 
+    int requestedBlockSize = 0;
     if (blockSizeOption)
+        requestedBlockSize = atoi(blockSizeOption);
+
+    // Out of range requests are ignored, leaving the default 512
+    if (requestedBlockSize >= TFTPServer::minBlockSize &&
+            requestedBlockSize <= TFTPServer::maxBlockSize)
     {
-        blockSize = atoi(blockSizeOption);
+        // Never more than fits in one unfragmented datagram
+        blockSize = (quint16)qMin(requestedBlockSize, (int)maxBlockSize);
 
-        emit verboseEvent(QString("Setting blksize to %1").arg(blockSize));
+        if (verbose)
+            emit verboseEvent(QString("Setting blksize to %1 (requested %2)")
+                              .arg(blockSize).arg(requestedBlockSize));
 
         oack.append(u8"blksize");
         oack.append((char)0);
@@ -177,201 +324,775 @@ bool TFTPTransfer::StartTransfer(QUdpSocket *,
         oack.append((char)0);
     }
     
-    const char *timeoutOption = TFTPServer::LookupOption(options, "timeout");
+    const char *windowSizeOption = options.Value(TFTPRequest::WINDOWSIZE);
+
+    if (windowSizeOption)
+    {
+        int requestedWindow = atoi(windowSizeOption);
+
+        // Clamp to valid range
+        if (requestedWindow < 1)
+            requestedWindow = 1;
+        if (requestedWindow > maxWindowSize)
+            requestedWindow = maxWindowSize;
+
+        windowSize = (quint16)requestedWindow;
+
+        if (verbose)
+            emit verboseEvent(QString("Setting windowsize to %1")
+                              .arg(windowSize));
+
+        oack.append(u8"windowsize");
+        oack.append((char)0);
+        oack.append(QString("%1").arg(windowSize).toUtf8());
+        oack.append((char)0);
+    }
+
+    const char *timeoutOption = options.Value(TFTPRequest::TIMEOUT);
     
     if (timeoutOption)
     {
-        retransmitInterval = (unsigned char)timeoutOption[0];
-        
+        // Decimal seconds, RFC 2349
+        int timeout = atoi(timeoutOption);
+
         // Clamp to valid range
-        if (retransmitInterval < 1)
-            retransmitInterval = 1;
-        if (retransmitInterval > 255)
-            retransmitInterval = 255;
-        
-        emit verboseEvent(QString("Setting timeout to %1 seconds")
-                          .arg(retransmitInterval));
-        
+        if (timeout < 1)
+            timeout = 1;
+        if (timeout > 255)
+            timeout = 255;
+
+        // Every retry must fit in the idle time, or the reaper ends
+        // the transfer before the client's timeout could
+        int maxTimeout = qMax(1, maxIdleTime / ((maxRetries + 1) * 1000));
+        if (timeout > maxTimeout)
+            timeout = maxTimeout;
+
+        if (verbose)
+            emit verboseEvent(QString("Setting timeout to %1 seconds")
+                              .arg(timeout));
+
+        // The client's timeout is where retransmission starts and
+        // the most the adaptive timeout backs off to
+        retransmitInterval = timeout * 1000;
+        maxRetransmitInterval = timeout * 1000;
+
         oack.append(u8"timeout");
         oack.append((char)0);
-        oack.append((char)retransmitInterval);
+        oack.append(QString("%1").arg(timeout).toUtf8());
         oack.append((char)0);
     }
 
-    qint64 sentSize;
+    const char *rolloverOption = options.Value(TFTPRequest::ROLLOVER);
 
-    // Send OACK if we set any options
-    if (oack.size() > 2)
+    // Block numbers wrap to 0 after 65535, as most clients expect.
+    // A client that asks for 1 instead gets it
+    if (rolloverOption && (!strcmp(rolloverOption, "0") ||
+                           !strcmp(rolloverOption, "1")))
     {
-        emit verboseEvent(QString("Sending OACK to %1").arg(blockSize));
-        
-        sentSize = sock->writeDatagram(oack, addr, port);
+        rolloverBase = (quint16)atoi(rolloverOption);
 
-        if (sentSize != oack.size())
-            emit ErrorEvent("Outbound OACK packet truncated!");
+        oack.append(u8"rollover");
+        oack.append((char)0);
+        oack.append(QString("%1").arg(rolloverBase).toUtf8());
+        oack.append((char)0);
     }
 
     clientAddr = addr;
     clientPort = port;
 
-    // Size the packet buffer
-    sendBuffer.resize(sizeof(BlockHeader) + blockSize);
+    // Send OACK if we set any options
+    if (oack.size() > 2)
+    {
+        if (verbose)
+            emit verboseEvent(QString("Sending OACK to %1").arg(blockSize));
+
+        SendOack(false);
+    }
+
+    fileSize = file->size();
+
+    // Serve from the shared cache when the file fits, so concurrent
+    // transfers of the same boot file don't each read it from disk
+    if (cache)
+    {
+        content = cache->Lookup(filename, file);
+
+        emit verboseEvent(QString("Cache %1 (hits=%2, misses=%3, used=%4)")
+                          .arg(content.isNull() ? "bypass" : "ready")
+                          .arg(cache->Hits())
+                          .arg(cache->Misses())
+                          .arg(cache->Used()));
+
+        // Cached content is the only copy needed
+        if (!content.isNull())
+            file->close();
+    }
+
+    if (!content.isNull())
+    {
+        source = content.constData();
+    }
+    else if (fileSize > 0 && mapFiles)
+    {
+        // Too big for the cache, map it instead of reading every block
+        source = (const char*)file->map(0, fileSize);
+        mapped = (source != nullptr);
+
+        if (!source)
+            emit verboseEvent(QString("Map failed, reading from disk: %1")
+                              .arg(file->errorString()));
+    }
+
+    // Only the read path needs a packet buffer
+    if (!source)
+    {
+        sendBuffer.resize(sizeof(BlockHeader) + blockSize);
+
+        // Keep the next couple of windows coming in from disk
+        readAhead = TFTPReadAhead::Create(file->handle(), blockSize, fileSize,
+                                          qMax(16, windowSize * 2));
+    }
+
+    // One sendmmsg per window
+    if (batch == &ownBatch)
+        ownBatch.SetCapacity(windowSize);
 
     // Start at block 1
     block = 1;
+    blockOffset = 0;
 
-    // Prepare packet
-    BlockHeader *header;
-    header = (BlockHeader*)sendBuffer.data();
+    // However long the retransmit timeout grows, a client that
+    // stops making progress is given up on eventually
+    wheel->Arm(&idleTimer, maxIdleTime);
 
-    header->opcode = qToBigEndian((quint16)DATA);
-    header->block = qToBigEndian(block);
+    // Send initial window if there wasn't an OACK sent
+    // (The client will send an ACK for block 0 to acknowledge OACK,
+    // which is handled like a duplicate ACK and sends the first window)
+    if (oack.size() <= 2)
+    {
+        SendWindow(false);
+    }
+
+    return true;
+}
 
-    // Read data directly into packet buffer
-    qint16 readSize;
-    readSize = file->read((char*)(header + 1), blockSize);
+bool TFTPTransfer::SendBlock(quint16 blockNumber, qint64 offset)
+{
+    if (source)
+    {
+        // Queue the header and a pointer to the payload, the batch
+        // sends them straight out of memory
+        BlockHeader header;
+        header.opcode = qToBigEndian((quint16)DATA);
+        header.block = qToBigEndian(blockNumber);
 
-    // Remember packet size for possible retransmit
-    sendSize = (quint16)(sizeof(BlockHeader) + readSize);
+        qint64 payloadSize = qMin((qint64)blockSize, fileSize - offset);
 
-    // Send initial packet if there wasn't an OACK sent
-    // (The client will send an ACK for block 0 to acknowledge OACK)
-    if (oack.size() <= 2)
+        batch->Queue(clientAddr, clientPort, &header, sizeof(header),
+                     source + offset, payloadSize);
+    }
+    else
     {
-        // Send initial DATA datagram
-        sentSize = sock->writeDatagram((char*)header, sendSize,
+        // Prepare packet
+        BlockHeader *header;
+        header = (BlockHeader*)sendBuffer.data();
+
+        header->opcode = qToBigEndian((quint16)DATA);
+        header->block = qToBigEndian(blockNumber);
+
+        qint64 readSize;
+
+        // Usually already read in the background, only a miss
+        // reads synchronously
+        if (!readAhead ||
+                !readAhead->Take(offset, (char*)(header + 1), &readSize))
+        {
+            // Blocks of a window are read sequentially, only a
+            // retransmit needs to move the file position backward
+            if (file->pos() != offset && !file->seek(offset))
+            {
+                emit ErrorEvent(QString("Seek to %1 failed").arg(offset));
+                return false;
+            }
+
+            // Read data directly into packet buffer
+            readSize = file->read((char*)(header + 1), blockSize);
+
+            if (readSize < 0)
+            {
+                emit ErrorEvent("Read failed!");
+                return false;
+            }
+        }
+
+        // The buffer is reused by the next block, send it now
+        qint64 sendSize = sizeof(BlockHeader) + readSize;
+        qint64 sentSize = sock->writeDatagram((char*)header, sendSize,
             clientAddr, clientPort);
 
         if (sentSize != sendSize)
-            emit ErrorEvent("Outbound initial data packet truncated!");
+            emit ErrorEvent("Outbound DATA packet truncated!");
     }
 
     return true;
 }
 
-void TFTPTransfer::OnPacketReceived()
+void TFTPTransfer::ReadAhead(qint64 offset)
 {
-    QHostAddress sourceAddr;
-    quint16 sourcePort;
+    if (readAhead)
+    {
+        TFTPReadAhead::Prefetch(readAhead, offset);
+        return;
+    }
 
-    while (sock->hasPendingDatagrams())
+#ifdef Q_OS_UNIX
+    // Ask the kernel to start paging in the next chunk of the mapping
+    // before a page fault would block this thread on it
+    if (mapped && offset + readAheadBytes / 2 > advisedOffset &&
+            advisedOffset < fileSize)
     {
-        int size = sock->pendingDatagramSize();
-        if (recvBuffer.size() < size)
-            recvBuffer.resize(size);
+        static const qint64 pageSize = sysconf(_SC_PAGESIZE);
 
-        size = sock->readDatagram(recvBuffer.data(), size,
-            &sourceAddr, &sourcePort);
+        qint64 start = advisedOffset & ~(pageSize - 1);
+        qint64 length = qMin(advisedOffset + readAheadBytes, fileSize) - start;
 
-        emit verboseEvent(QString("Datagram received, size=%1").arg(size));
+        madvise((void*)(source + start), length, MADV_WILLNEED);
+
+        advisedOffset = start + length;
+    }
+#else
+    Q_UNUSED(offset);
+#endif
+}
+
+quint16 TFTPTransfer::WireBlock(qint64 sequence) const
+{
+    if (sequence <= 65535)
+        return (quint16)sequence;
+
+    return (quint16)(rolloverBase +
+                     (sequence - 65536) % (65536 - rolloverBase));
+}
+
+void TFTPTransfer::SendOack(bool retransmit)
+{
+    qint64 sentSize = sock->writeDatagram(oack, clientAddr, clientPort);
+
+    if (sentSize != oack.size())
+        emit ErrorEvent("Outbound OACK packet truncated!");
+
+    // An ACK could answer either copy, so it is no RTT sample
+    if (retransmit)
+        oackTimer.invalidate();
+    else
+        oackTimer.start();
+
+    // Lost like any DATA packet would be, until block 0 is acked
+    wheel->Arm(&retransmitTimer, retransmitInterval);
+}
+
+void TFTPTransfer::SendWindow(bool retransmit)
+{
+    if (retransmit)
+    {
+        windowRetransmitted = true;
+    }
+    else
+    {
+        windowTimer.start();
+        windowRetransmitted = false;
+    }
+
+    // Send up to windowSize blocks, starting at the first
+    // unacknowledged block, as the scheduler gets around to us
+    sendBlock = block;
+    sendOffset = blockOffset;
+    sendRemaining = windowSize;
+
+    // Restarted once the whole window is out
+    wheel->Cancel(&retransmitTimer);
+
+    Schedule();
+}
+
+void TFTPTransfer::Schedule()
+{
+    wheel->Cancel(&paceTimer);
+
+    if (scheduled)
+        return;
+
+    deficit = 0;
+    scheduled = true;
+    scheduler->Schedule(this);
+}
+
+qint64 TFTPTransfer::Remaining() const
+{
+    return fileSize - sendOffset;
+}
+
+bool TFTPTransfer::SendQuantum(int quantum)
+{
+    qint64 firstBlock = sendBlock;
+    int wait = 0;
+    bool done = false;
+
+    deficit += quantum;
 
-        // Drop packets from wrong client
-        if (sourceAddr != clientAddr || sourcePort != clientPort)
+    for (;;)
+    {
+        // A block exists as long as its offset does not go past the
+        // end of the file, the block at exactly the end of the file
+        // being the zero length terminator
+        if (sendRemaining == 0 || sendOffset > fileSize)
         {
-            emit ErrorEvent("Dropped packet from wrong source");
-            continue;
+            done = true;
+            break;
         }
 
-        BlockHeader header, *headerPtr;
-        headerPtr = (BlockHeader*)recvBuffer.data();
+        qint64 packetSize = sizeof(BlockHeader) +
+                qMin((qint64)blockSize, fileSize - sendOffset);
 
-        header.opcode = qFromBigEndian(headerPtr->opcode);
-        header.block = qFromBigEndian(headerPtr->block);
+        // Carried over to the next round
+        if (packetSize > deficit)
+            break;
 
-        // Drop packets that are not acknowledgements
-        if (header.opcode != ACK)
+        // Out of tokens, the rest of the window waits for them. The
+        // tokens for this packet are taken already, it goes first
+        // when the wait is over
+        if (!prepaid)
         {
-            emit ErrorEvent(QString("Receive error ACK,"
-                                    " opcode=%1, error=%2, message=%3")
-                            .arg(header.opcode)
-                            .arg(header.block)
-                            .arg((char*)(headerPtr+1)));
-            sock->close();
-            retransmitTimer->stop();
-            deleteLater();
-            return;
+            wait = limiter->Take(clientAddr, packetSize);
+            if (wait > 0)
+            {
+                prepaid = true;
+                break;
+            }
+        }
+
+        prepaid = false;
+
+        if (!SendBlock(WireBlock(sendBlock), sendOffset))
+        {
+            done = true;
+            break;
+        }
+
+        deficit -= packetSize;
+
+        ++sendBlock;
+        sendOffset += blockSize;
+        --sendRemaining;
+    }
+
+    ReadAhead(sendOffset);
+
+    // A multiplexed socket coalesces the packets of every transfer
+    // until the event loop comes back around
+    if (mux)
+    {
+        mux->ScheduleFlush();
+    }
+    else
+    {
+        int queued = batch->Pending();
+        if (batch->Flush() != queued)
+            emit ErrorEvent("Outbound DATA packets dropped!");
+    }
+
+    if (verbose && sendBlock != firstBlock)
+        emit verboseEvent(QString("Sent %1 block(s) starting at %2")
+                          .arg(sendBlock - firstBlock)
+                          .arg(firstBlock));
+
+    if (done)
+    {
+        scheduled = false;
+        wheel->Arm(&retransmitTimer, retransmitInterval);
+        return false;
+    }
+
+    if (wait > 0)
+    {
+        // The client can't be blamed for blocks not sent yet, the
+        // retransmit timeout starts once the whole window is out.
+        // The delay would also spoil the round trip sample
+        scheduled = false;
+        windowRetransmitted = true;
+        wheel->Arm(&paceTimer, wait);
+        return false;
+    }
+
+    return true;
+}
+
+void TFTPTransfer::Supersede()
+{
+    emit ErrorEvent(QString("%1:%2 started over, abandoning its transfer")
+                    .arg(clientAddr.toString()).arg(clientPort));
+
+    outcome = TFTPSessionTable::ABORTED;
+    Finish();
+}
+
+void TFTPTransfer::DetachMultiplexer()
+{
+    registered = false;
+}
+
+void TFTPTransfer::DetachScheduler()
+{
+    scheduled = false;
+}
+
+void TFTPTransfer::Finish()
+{
+    wheel->Cancel(&retransmitTimer);
+    wheel->Cancel(&idleTimer);
+    wheel->Cancel(&paceTimer);
+
+    if (scheduled)
+    {
+        scheduler->Remove(this);
+        scheduled = false;
+    }
+
+    // The multiplexed socket is shared, only stop routing to us.
+    // Queued packets may point into our data, send them first
+    if (registered)
+    {
+        mux->Flush();
+        mux->Unregister(clientAddr, clientPort, this);
+    }
+    else if (!mux && sock)
+    {
+        // Nothing left to send once the transfer is over, and the
+        // batch must not wait on a closed descriptor
+        ownBatch.Discard();
+        sock->close();
+    }
+
+    registered = false;
+
+    Recycle();
+}
+
+void TFTPTransfer::Recycle()
+{
+    if (listed)
+    {
+        sessions->Remove(clientAddr, clientPort, this, outcome);
+        listed = false;
+    }
+
+    // Let go of the file, its mapping or cached content, and any
+    // reads still in flight
+    readAhead.reset();
+    content = QByteArray();
+    source = nullptr;
+    mapped = false;
+    advisedOffset = 0;
+
+    if (file)
+        file->close();
+
+    // Back to what a new transfer starts with
+    outcome = TFTPSessionTable::ABORTED;
+    blockSize = 512;
+    windowSize = 1;
+    maxBlockSize = TFTPServer::maxBlockSize;
+    blockOffset = 0;
+    fileSize = 0;
+    rolloverBase = 0;
+    sendRemaining = 0;
+    prepaid = false;
+    retransmitInterval = initialRetransmitInterval;
+    smoothedRtt = -1;
+    rttVariance = 0;
+    maxRetransmitInterval = defaultMaxRetransmitInterval;
+    retries = 0;
+    windowTimer.invalidate();
+    windowRetransmitted = false;
+    oackTimer.invalidate();
+
+    ++generation;
+
+    // Callers are still on the stack, the listener must not be able
+    // to hand us to another client until they have returned
+    QMetaObject::invokeMethod(this, "ReturnToPool", Qt::QueuedConnection);
+}
+
+void TFTPTransfer::ReturnToPool()
+{
+    // Kept for the next request, unless the pool is full
+    if (!pool->Release(this))
+        deleteLater();
+}
+
+void TFTPTransfer::OnPacketReceived()
+{
+    int count;
+
+    while ((count = recvBatch->Receive(sock)) > 0)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            // Oversized, can't be an ACK
+            if (recvBatch->Size(i) < 0)
+                continue;
+
+            if (!ProcessDatagram(recvBatch->Data(i), recvBatch->Size(i),
+                                 recvBatch->Address(i), recvBatch->Port(i)))
+                return;
         }
+    }
+}
 
-        // Remove spam message
+bool TFTPTransfer::ProcessDatagram(const char *data, int size,
+    const QHostAddress &sourceAddr, quint16 sourcePort)
+{
+    if (verbose)
+        emit verboseEvent(QString("Datagram received, size=%1").arg(size));
+
+    // Drop packets from wrong client
+    if (sourceAddr != clientAddr || sourcePort != clientPort)
+    {
+        emit ErrorEvent("Dropped packet from wrong source");
+        return true;
+    }
+
+    // Drop packets too small to hold an opcode and block number
+    if (size < (int)sizeof(BlockHeader))
+    {
+        emit ErrorEvent("Dropped runt packet");
+        return true;
+    }
+
+    BlockHeader header;
+    const BlockHeader *headerPtr;
+    headerPtr = (const BlockHeader*)data;
+
+    header.opcode = qFromBigEndian(headerPtr->opcode);
+    header.block = qFromBigEndian(headerPtr->block);
+
+    // Drop packets that are not acknowledgements
+    if (header.opcode != ACK)
+    {
+        emit ErrorEvent(QString("Receive error ACK,"
+                                " opcode=%1, error=%2, message=%3")
+                        .arg(header.opcode)
+                        .arg(header.block)
+                        .arg(QString::fromLocal8Bit(
+                                 (const char*)(headerPtr+1),
+                                 size - (int)sizeof(BlockHeader))));
+        Finish();
+        return false;
+    }
+
+    if (verbose)
         emit verboseEvent(QString("Received ACK for %1").arg(header.block));
 
-        qint64 sentSize;
+    // Acknowledgement for the previous block is a request
+    // to retransmit. The ACK of the OACK is the first one, it
+    // starts the first window and doubles as an RTT sample
+    if (header.block == WireBlock(block - 1))
+    {
+        bool first = (blockOffset == 0 && !windowTimer.isValid());
 
-        // Acknowledgement for the previous block is a request
-        // to retransmit
-        if (header.block == (quint16)(block-1))
+        if (first)
         {
-            // Retransmit current packet
-            sentSize = sock->writeDatagram(sendBuffer.data(), sendSize,
-                clientAddr, clientPort);
+            if (oackTimer.isValid())
+                SampleRtt(oackTimer.elapsed());
 
-            emit verboseEvent(QString("Retransmitted packet %1").arg(block));
-            
-            retransmitTimer->start(retransmitInterval);
+            wheel->Arm(&idleTimer, maxIdleTime);
 
-            if (sentSize != sendSize)
-                emit ErrorEvent("Outbound retransmitted packet truncated!");
+            SendWindow(false);
+        }
+        else
+        {
+            // Retransmit current window
+            SendWindow(true);
 
-            continue;
+            if (verbose)
+                emit verboseEvent(QString("Retransmitted window at %1")
+                                  .arg(block));
         }
 
-        // Drop acknowledgements that are for wrong block
-        if (header.block != block)
-        {
-            // Reset retransmit timer
-            retransmitTimer->start(retransmitInterval);
-            
+        return true;
+    }
+
+    // Position of the acknowledged block within the window. The
+    // window is short, and with a rollover to 1 the distance across
+    // the wrap is not a plain difference, so look for it
+    int windowIndex = 0;
+    while (windowIndex < windowSize &&
+           WireBlock(block + windowIndex) != header.block)
+        ++windowIndex;
+
+    qint64 ackedOffset = blockOffset + (qint64)windowIndex * blockSize;
+
+    // Drop acknowledgements that are outside the window. The
+    // retransmit timer keeps running, a stream of stale ACKs
+    // must not be able to postpone retransmission forever
+    if (windowIndex >= windowSize || ackedOffset > fileSize)
+    {
+        if (verbose)
             emit verboseEvent("Dropped acknowledgement"
                               " for unexpected block number");
-            continue;
-        }
+        return true;
+    }
 
-        retransmitTimer->stop();
-        
-        if (sendSize < sizeof(BlockHeader) + blockSize)
-        {
-            emit verboseEvent("Got ACK for last block, destroying transfer");
-            
-            sock->close();
-            deleteLater();
-            return;
-        }
+    wheel->Cancel(&retransmitTimer);
+
+    // Progress, measure the round trip unless ambiguous
+    if (!windowRetransmitted)
+        SampleRtt(windowTimer.elapsed());
+
+    retries = 0;
+    wheel->Arm(&idleTimer, maxIdleTime);
+
+    // The last block is the first one that is not full
+    if (fileSize - ackedOffset < blockSize)
+    {
+        emit verboseEvent("Got ACK for last block, destroying transfer");
+
+        outcome = TFTPSessionTable::COMPLETED;
+        Finish();
+        return false;
+    }
 
-        ++block;
+    // The acknowledgement is cumulative. If it is short of the
+    // end of the window, the client lost a block and the next
+    // window starts right after the last block it received
+    block += windowIndex + 1;
+    blockOffset = ackedOffset + blockSize;
 
+    if (verbose)
         emit verboseEvent(QString("Sending block %1").arg(block));
 
-        // Prepare a new send packet
-        headerPtr = (BlockHeader*)sendBuffer.data();
-        headerPtr->opcode = qToBigEndian((quint16)DATA);
-        headerPtr->block = qToBigEndian(block);
+    SendWindow(false);
 
-        qint64 readSize;
-        readSize = file->read((char*)(headerPtr+1), blockSize);
+    return true;
+}
 
-        sendSize = sizeof(BlockHeader) + readSize;
+void TFTPTransfer::SampleRtt(int rtt)
+{
+    // RFC 6298 with the usual 1/8 and 1/4 gains
+    if (smoothedRtt < 0)
+    {
+        smoothedRtt = rtt;
+        rttVariance = rtt / 2;
+    }
+    else
+    {
+        rttVariance = (3 * rttVariance + qAbs(smoothedRtt - rtt)) / 4;
+        smoothedRtt = (7 * smoothedRtt + rtt) / 8;
+    }
 
-        sentSize = sock->writeDatagram((char*)sendBuffer.data(), sendSize,
-            clientAddr, clientPort);
+    retransmitInterval = qBound(minRetransmitInterval,
+                                smoothedRtt + qMax(1, 4 * rttVariance),
+                                maxRetransmitInterval);
+}
 
-        if (sentSize != sendSize)
-            emit ErrorEvent("Outbound DATA packet truncated!");
-        
-        retransmitTimer->start(retransmitInterval);
+bool TFTPTransfer::OnTimeout()
+{
+    if (++retries > maxRetries)
+    {
+        emit ErrorEvent(QString("Giving up on block %1 after %2 retries")
+                        .arg(block).arg(maxRetries));
+        SendErrorPacket(sock, clientAddr, clientPort,
+                        NOTDEFINED, "Timeout");
+        outcome = TFTPSessionTable::REAPED;
+        Finish();
+        return false;
     }
+
+    // Exponential backoff, until an ACK gives a fresh sample
+    retransmitInterval = qMin(retransmitInterval * 2, maxRetransmitInterval);
+
+    return true;
 }
 
-void TFTPTransfer::OnRetransmitTimer()
+void TFTPTransfer::OnDuplicateRequest(quint32 requestGeneration)
 {
-    // Retransmit current packet
-    qint64 sentSize = sock->writeDatagram(sendBuffer.data(), sendSize,
-        clientAddr, clientPort);
+    // Meant for the client we served before being recycled
+    if (requestGeneration != generation)
+        return;
 
-    emit verboseEvent(QString("Retransmitted packet %1").arg(block));
+    // Failed to start, nothing to answer with
+    if (!sock || (mux && !registered))
+        return;
 
-    if (sentSize != sendSize)
-        emit ErrorEvent("Outbound retransmitted packet truncated!");
-    
-    retransmitTimer->start(retransmitInterval);
+    // Nothing got through yet. Answer again with whatever the
+    // original request was answered with
+    if (windowTimer.isValid())
+    {
+        if (block != 1)
+            return;
+
+        SendWindow(true);
+    }
+    else if (oack.size() > 2)
+    {
+        SendOack(true);
+    }
+
+    emit verboseEvent(QString("Answered duplicate request from %1:%2")
+                      .arg(clientAddr.toString()).arg(clientPort));
 }
 
+void TFTPTransfer::OnSuperseded(quint32 requestGeneration)
+{
+    if (requestGeneration != generation)
+        return;
+
+    Supersede();
+}
+
+void TFTPTransfer::OnTimer(TFTPTimerWheel::Timer *timer)
+{
+    if (timer == &retransmitTimer)
+        OnRetransmitTimer();
+    else if (timer == &idleTimer)
+        OnIdleTimer();
+    else if (timer == &paceTimer)
+        Schedule();
+}
+
+void TFTPTransfer::OnIdleTimer()
+{
+    emit ErrorEvent(QString("Reaping transfer to %1:%2, no progress"
+                            " in %3ms (%4 reaped so far)")
+                    .arg(clientAddr.toString()).arg(clientPort)
+                    .arg(maxIdleTime)
+                    .arg(sessions->Count(TFTPSessionTable::REAPED) + 1));
+
+    SendErrorPacket(sock, clientAddr, clientPort, NOTDEFINED, "Timeout");
+    outcome = TFTPSessionTable::REAPED;
+    Finish();
+}
+
+void TFTPTransfer::OnRetransmitTimer()
+{
+    if (!OnTimeout())
+        return;
+
+    // Still waiting for the ACK of the OACK, no window went out yet
+    if (block == 1 && !windowTimer.isValid())
+    {
+        SendOack(true);
+
+        if (verbose)
+            emit verboseEvent(QString("Retransmitted OACK, timeout %1ms")
+                              .arg(retransmitInterval));
+        return;
+    }
+
+    // Retransmit current window
+    SendWindow(true);
+
+    if (verbose)
+        emit verboseEvent(QString("Retransmitted window at %1, timeout %2ms")
+                          .arg(block).arg(retransmitInterval));
+}
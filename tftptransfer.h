@@ -20,14 +20,25 @@
 #include <QHostAddress>
 #include <QUdpSocket>
 #include <QFile>
-#include <QTimer>
+#include <QElapsedTimer>
 
 #include "tftpserver.h"
+#include "tftpfilecache.h"
+#include "udpbatch.h"
+#include "tftpreadahead.h"
+#include "tftptimerwheel.h"
+#include "tftpsessiontable.h"
+#include "tftpsessionpool.h"
+#include "tftpratelimiter.h"
+#include "tftpsendscheduler.h"
+
+class TFTPMultiplexer;
 
 class TFTPTransfer : public QObject
 {
     Q_OBJECT
 
+public:
     enum Opcodes
     {
         RRQ = 1,
@@ -50,23 +61,188 @@ class TFTPTransfer : public QObject
         NOSUCHUSER
     };
 
-    QByteArray recvBuffer;
+    // DATA and ACK packets start with this structure
+    // Error packets do too, except "block" holds the error code
+    struct BlockHeader
+    {
+        quint16 opcode;
+        quint16 block;
+    };
+
+    // Largest ACK or ERROR accepted from a client
+    static const int maxControlPacket = 516;
+
+private:
+
+    // Copy of the request datagram, the options point into it
+    QByteArray requestPacket;
+    TFTPRequest request;
+    QString requestPath;
 
     QFile *file;
     QUdpSocket *sock;
+
+    // When set, sock is the multiplexer's shared socket and
+    // incoming packets are routed to ProcessDatagram
+    TFTPMultiplexer *mux;
+    bool registered;
+
+    // Only used with a socket of our own
+    UdpRecvBatch *recvBatch;
+    UdpSendBatch ownBatch;
+
+    // DATA packets are queued here, either ownBatch or the
+    // multiplexer's batch
+    UdpSendBatch *batch;
+
+    // Whole file content when it is served from the cache
+    TFTPFileCache *cache;
+    QByteArray content;
+
+    // Where this transfer is listed, and how it ended
+    TFTPSessionTable *sessions;
+    bool listed;
+    TFTPSessionTable::Outcome outcome;
+
+    // Where we go when finished, to be reused
+    TFTPSessionPool *pool;
+
+    // Bumped every time the transfer is recycled. Notifications
+    // queued for an earlier client carry an older value
+    quint32 generation;
+
+    // Paces DATA, the rest of a window waits on paceTimer for tokens.
+    // Prepaid when the next packet's tokens were taken before waiting
+    TFTPRateLimiter *limiter;
+    TFTPTimerWheel::Timer paceTimer;
+    bool prepaid;
+    qint64 sendBlock;
+    qint64 sendOffset;
+    int sendRemaining;
+
+    // Blocks of the window are sent when the thread's scheduler
+    // gives us a turn, deficit is the bytes we may still send
+    TFTPSendScheduler *scheduler;
+    bool scheduled;
+    int deficit;
+
+    // File data in memory, either the cached content or a mapping
+    // of the file. Null when blocks are read from disk
+    const char *source;
+
+    // Source is a mapping of the file, paged in ahead of the window
+    // with madvise up to advisedOffset
+    bool mapped;
+    qint64 advisedOffset;
+    static const qint64 readAheadBytes = 1024 * 1024;
+
+    // Map files the cache can't take, instead of reading them
+    bool mapFiles;
+
+    // Background reads for the read path
+    QSharedPointer<TFTPReadAhead> readAhead;
+
+    // Options acknowledged, kept to answer a repeated request
+    QByteArray oack;
+
     QByteArray sendBuffer;
-    quint16 sendSize;
-    quint16 block;
+
+    // Sequence number of the first unacknowledged block, counting
+    // from 1 without wrapping. Only the wire block number wraps
+    qint64 block;
     quint16 blockSize;
+    quint16 windowSize;
+
+    // Largest blksize that avoids IP fragmentation to this client
+    quint16 maxBlockSize;
+
+    // File offset of the first unacknowledged block
+    qint64 blockOffset;
+    qint64 fileSize;
+
+    // Wire block number that follows 65535. 0 unless the client
+    // asked for 1 with the rollover option
+    quint16 rolloverBase;
+
+    quint16 WireBlock(qint64 sequence) const;
 
     QHostAddress clientAddr;
     quint16 clientPort;
     
-    QTimer *retransmitTimer;
+    // Shared by all transfers on this thread
+    TFTPTimerWheel *wheel;
+    TFTPTimerWheel::Timer retransmitTimer;
+
+    // Current retransmission timeout in milliseconds, derived from
+    // the smoothed round trip time as in RFC 6298, and doubled on
+    // every timeout
     int retransmitInterval;
+    int smoothedRtt;
+    int rttVariance;
+    int maxRetransmitInterval;
+
+    // Consecutive timeouts without progress
+    int retries;
+
+    // Time since the current window was first sent. Karn's rule:
+    // no RTT sample from a window that had to be retransmitted
+    QElapsedTimer windowTimer;
+    bool windowRetransmitted;
+
+    // Time since the OACK was sent, the first RTT sample. Same
+    // rule, invalidated when the OACK had to be sent again
+    QElapsedTimer oackTimer;
+
+    static const int initialRetransmitInterval = 1000;
+    static const int minRetransmitInterval = 50;
+    static const int defaultMaxRetransmitInterval = 10000;
+    static const int maxRetries = 8;
+
+    // Longest a transfer may go without progress, regardless of
+    // retries. Covers a client that negotiated a long timeout
+    TFTPTimerWheel::Timer idleTimer;
+    int maxIdleTime;
+
+    // Per packet messages, checked before they are formatted. Each one
+    // is queued to the listener's thread, which also answers DHCP
+    bool verbose;
+
+    void SampleRtt(int rtt);
+    bool OnTimeout();
+
+    // RFC 7440 allows up to 65535, but keep bursts modest
+    static const quint16 maxWindowSize = 64;
+
+    void SendOack(bool retransmit);
+    bool SendBlock(quint16 blockNumber, qint64 offset);
+    void SendWindow(bool retransmit);
+    void Schedule();
+    void ReadAhead(qint64 offset);
+    void Finish();
+    void Recycle();
 
 public:
-    explicit TFTPTransfer(QObject *parent = 0);
+    TFTPTransfer(TFTPFileCache *cache, TFTPSessionTable *sessions,
+                 TFTPSessionPool *pool, TFTPMultiplexer *mux,
+                 TFTPTimerWheel *wheel, TFTPSendScheduler *scheduler,
+                 QObject *parent = 0);
+    ~TFTPTransfer();
+
+    static const int defaultMaxIdleTime = 120000;
+
+    // The client sent a new request from the same port, finish
+    // without telling it, the error would end the new transfer too
+    void Supersede();
+
+    // The multiplexer is going away, don't unregister later
+    void DetachMultiplexer();
+
+    // Same for the send scheduler
+    void DetachScheduler();
+
+    // Returns false if the transfer finished
+    bool ProcessDatagram(const char *data, int size,
+        const QHostAddress &sourceAddr, quint16 sourcePort);
 
     void SendErrorPacket(QUdpSocket *target,
         const QHostAddress &address, quint16 port,
@@ -77,20 +253,61 @@ public:
 
     bool StartTransfer(
             QUdpSocket *listener, const QHostAddress &addr, quint16 port,
-            quint16 opcode, const QString &serverRoot,
-            const TFTPServer::OptionList &options);
+            const QString &filename, const TFTPRequest &options);
+
+    // Keep a copy of the request so the transfer can be started
+    // later, from the thread it is moved to
+    void SetRequest(const QHostAddress &addr, quint16 port,
+            const QString &filename, const char *packet, int size,
+            const TFTPRequest &options);
+
+    void SetMaxBlockSize(quint16 size);
+    void SetMaxIdleTime(int ms);
+    void SetRateLimiter(TFTPRateLimiter *rateLimiter);
+    void SetVerbose(bool enable);
+    void SetMapFiles(bool enable);
+
+    // Read by the listener after Acquire, the pool's lock orders it
+    // after the Recycle that changed it
+    quint32 Generation() const;
+
+    // Sends from the pending window, up to quantum bytes plus what
+    // was left over from the last turn. Returns false once there is
+    // nothing more to send for now
+    bool SendQuantum(int quantum);
+
+    // Bytes of the file not sent yet
+    qint64 Remaining() const;
+
+    // Called by the wheel when one of our timers expires
+    void OnTimer(TFTPTimerWheel::Timer *timer);
     
-    static QString TranslateFilename(
-            const QString &serverRoot, const char *filename);
 
 signals:
     void verboseEvent(const QString &msg);
     void ErrorEvent(const QString &msg);
     
 public slots:
+    // Ignored if the transfer was superseded before it got to start
+    void Start(quint32 requestGeneration);
+
     void OnPacketReceived();
-    
+
+    // The client repeated its request, ignored if the transfer was
+    // recycled since it was queued
+    void OnDuplicateRequest(quint32 requestGeneration);
+
+    // Same, for a new request from the client's port
+    void OnSuperseded(quint32 requestGeneration);
+
+private slots:
+    // Queued by Recycle, so nothing up the stack still uses us when
+    // the listener can take us again
+    void ReturnToPool();
+
+private:
     void OnRetransmitTimer();
+    void OnIdleTimer();
 };
 
 #endif // TFTPTRANSFER_H
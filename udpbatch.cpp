@@ -0,0 +1,560 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include "udpbatch.h"
+
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QThread>
+
+#ifdef Q_OS_UNIX
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#endif
+
+#ifdef Q_OS_LINUX
+static const size_t pktInfoSpace = CMSG_SPACE(sizeof(in_pktinfo));
+#endif
+
+// Dual stack sockets report IPv4 peers as mapped IPv6 addresses,
+// report them as plain IPv4 so they compare equal everywhere
+static void NormalizeAddress(QHostAddress &addr)
+{
+    bool isIPv4;
+    quint32 ipv4 = addr.toIPv4Address(&isIPv4);
+    if (isIPv4)
+        addr.setAddress(ipv4);
+}
+
+#ifdef Q_OS_UNIX
+socklen_t UdpSockAddr(QUdpSocket *sock, const QHostAddress &addr,
+                      quint16 port, sockaddr_storage *dest)
+{
+    bool isIPv4;
+    quint32 ipv4 = addr.toIPv4Address(&isIPv4);
+
+    memset(dest, 0, sizeof(*dest));
+
+    // Sockets bound to Any are dual stack IPv6 sockets,
+    // IPv4 peers are reached through mapped addresses
+    if (sock->localAddress().protocol() == QAbstractSocket::IPv6Protocol)
+    {
+        sockaddr_in6 *sin6 = (sockaddr_in6*)dest;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+
+        if (isIPv4)
+        {
+            quint32 be = htonl(ipv4);
+            sin6->sin6_addr.s6_addr[10] = 0xFF;
+            sin6->sin6_addr.s6_addr[11] = 0xFF;
+            memcpy(sin6->sin6_addr.s6_addr + 12, &be, sizeof(be));
+        }
+        else
+        {
+            Q_IPV6ADDR ipv6 = addr.toIPv6Address();
+            memcpy(sin6->sin6_addr.s6_addr, &ipv6, sizeof(ipv6));
+        }
+
+        return sizeof(sockaddr_in6);
+    }
+
+    if (!isIPv4)
+        return 0;
+
+    sockaddr_in *sin = (sockaddr_in*)dest;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = htonl(ipv4);
+
+    return sizeof(sockaddr_in);
+}
+#endif
+
+UdpRecvBatch::UdpRecvBatch(int capacity, int slotSize)
+    : slotSize(slotSize)
+    , datagrams(capacity)
+{
+    buffer.resize(capacity * slotSize);
+
+#ifdef Q_OS_LINUX
+    msgs.resize(capacity);
+    iovs.resize(capacity);
+    addrs.resize(capacity);
+    control.resize(capacity * pktInfoSpace);
+
+    for (int i = 0; i < capacity; ++i)
+    {
+        iovs[i].iov_base = buffer.data() + i * slotSize;
+        iovs[i].iov_len = slotSize;
+    }
+#endif
+}
+
+bool UdpRecvBatch::EnablePacketInfo(QUdpSocket *sock)
+{
+#ifdef Q_OS_LINUX
+    int enable = 1;
+    return setsockopt(sock->socketDescriptor(), IPPROTO_IP, IP_PKTINFO,
+                      &enable, sizeof(enable)) == 0;
+#else
+    Q_UNUSED(sock);
+    return false;
+#endif
+}
+
+int UdpRecvBatch::Receive(QUdpSocket *sock)
+{
+    int capacity = datagrams.size();
+
+#ifdef Q_OS_LINUX
+    // The kernel overwrites the name length and flags
+    for (int i = 0; i < capacity; ++i)
+    {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control.data() + i * pktInfoSpace;
+        msgs[i].msg_hdr.msg_controllen = pktInfoSpace;
+    }
+
+    int count = recvmmsg(sock->socketDescriptor(), msgs.data(), capacity,
+                         MSG_DONTWAIT, nullptr);
+
+    // EAGAIN when drained, anything else is treated the same,
+    // the socket notifier will fire again if there is more
+    if (count < 0)
+        return 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        Slot &slot = datagrams[i];
+
+        slot.addr = QHostAddress((sockaddr*)&addrs[i]);
+        NormalizeAddress(slot.addr);
+
+        const sockaddr *sa = (const sockaddr*)&addrs[i];
+        if (sa->sa_family == AF_INET6)
+            slot.port = ntohs(((const sockaddr_in6*)sa)->sin6_port);
+        else
+            slot.port = ntohs(((const sockaddr_in*)sa)->sin_port);
+
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            slot.size = -1;
+        else
+            slot.size = msgs[i].msg_len;
+
+        slot.ifindex = 0;
+        slot.local.clear();
+
+        msghdr *hdr = &msgs[i].msg_hdr;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg;
+             cmsg = CMSG_NXTHDR(hdr, cmsg))
+        {
+            if (cmsg->cmsg_level != IPPROTO_IP ||
+                    cmsg->cmsg_type != IP_PKTINFO)
+                continue;
+
+            in_pktinfo info;
+            memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+
+            slot.ifindex = info.ipi_ifindex;
+            slot.local.setAddress(ntohl(info.ipi_spec_dst.s_addr));
+        }
+    }
+
+    return count;
+#else
+    int count = 0;
+
+    while (count < capacity && sock->hasPendingDatagrams())
+    {
+        Slot &slot = datagrams[count];
+
+        qint64 pending = sock->pendingDatagramSize();
+
+        qint64 size = sock->readDatagram(buffer.data() + count * slotSize,
+            slotSize, &slot.addr, &slot.port);
+
+        if (size < 0)
+            break;
+
+        NormalizeAddress(slot.addr);
+        slot.size = pending > slotSize ? -1 : (int)size;
+
+        slot.ifindex = 0;
+        slot.local.clear();
+
+        ++count;
+    }
+
+    return count;
+#endif
+}
+
+const char *UdpRecvBatch::Data(int i) const
+{
+    return buffer.constData() + i * slotSize;
+}
+
+int UdpRecvBatch::Size(int i) const
+{
+    return datagrams[i].size;
+}
+
+const QHostAddress &UdpRecvBatch::Address(int i) const
+{
+    return datagrams[i].addr;
+}
+
+quint16 UdpRecvBatch::Port(int i) const
+{
+    return datagrams[i].port;
+}
+
+int UdpRecvBatch::InterfaceIndex(int i) const
+{
+    return datagrams[i].ifindex;
+}
+
+const QHostAddress &UdpRecvBatch::LocalAddress(int i) const
+{
+    return datagrams[i].local;
+}
+
+UdpSendBatch::UdpSendBatch(int capacity)
+    : sock(nullptr)
+    , count(0)
+    , sourceIndex(0)
+    , writeNotifier(nullptr)
+    , retryTimer(nullptr)
+{
+    SetCapacity(capacity);
+}
+
+UdpSendBatch::~UdpSendBatch()
+{
+    StopWaiting();
+}
+
+void UdpSendBatch::SetSocket(QUdpSocket *socket)
+{
+    // Kept datagrams were meant to leave through the old socket
+    if (socket != sock)
+        Discard();
+
+    sock = socket;
+}
+
+void UdpSendBatch::SetCapacity(int capacity)
+{
+    Flush();
+    Resize(qMax(capacity, count));
+}
+
+void UdpSendBatch::Resize(int capacity)
+{
+    entries.resize(capacity);
+
+#ifdef Q_OS_LINUX
+    msgs.resize(capacity);
+    iovs.resize(capacity * 2);
+    control.resize(capacity * pktInfoSpace);
+    msgEntries.resize(capacity);
+#endif
+}
+
+void UdpSendBatch::Discard()
+{
+    for (int i = 0; i < count; ++i)
+        entries[i].owned.clear();
+
+    count = 0;
+    StopWaiting();
+}
+
+void UdpSendBatch::StopWaiting()
+{
+    // Notifiers must go away on the thread they were made on
+    if (writeNotifier)
+    {
+        writeNotifier->setEnabled(false);
+        if (writeNotifier->thread() == QThread::currentThread())
+            delete writeNotifier;
+        else
+            writeNotifier->deleteLater();
+        writeNotifier = nullptr;
+    }
+
+    if (retryTimer)
+    {
+        if (retryTimer->thread() == QThread::currentThread())
+            delete retryTimer;
+        else
+            retryTimer->deleteLater();
+        retryTimer = nullptr;
+    }
+}
+
+void UdpSendBatch::Retain(const int *keep, int keepCount, bool bufferFull)
+{
+    for (int i = 0; i < keepCount; ++i)
+    {
+        Entry &entry = entries[keep[i]];
+
+        // The caller may reuse the payload as soon as Flush returns
+        if (entry.owned.constData() != entry.payload)
+        {
+            entry.owned = QByteArray(entry.payload, entry.payloadSize);
+            entry.payload = entry.owned.constData();
+        }
+
+        if (keep[i] != i)
+        {
+            entries[i] = entry;
+            entries[i].payload = entries[i].owned.constData();
+        }
+    }
+
+    for (int i = keepCount; i < count; ++i)
+        entries[i].owned.clear();
+
+    count = keepCount;
+
+    if (!count)
+    {
+        StopWaiting();
+        return;
+    }
+
+    // Direct connections, this object may not live on the flushing
+    // thread. An unconnected QUdpSocket never enables a write notifier
+    // of its own, so this one is the only one on the descriptor
+    if (bufferFull && sock)
+    {
+        if (!writeNotifier)
+        {
+            writeNotifier = new QSocketNotifier(sock->socketDescriptor(),
+                                                QSocketNotifier::Write);
+            connect(writeNotifier, SIGNAL(activated(int)),
+                    this, SLOT(OnWritable()), Qt::DirectConnection);
+        }
+        writeNotifier->setEnabled(true);
+    }
+    else
+    {
+        // ENOBUFS, the socket looks writable but the device queue is
+        // full, try again shortly
+        if (!retryTimer)
+        {
+            retryTimer = new QTimer;
+            retryTimer->setSingleShot(true);
+            connect(retryTimer, SIGNAL(timeout()),
+                    this, SLOT(OnWritable()), Qt::DirectConnection);
+        }
+        retryTimer->start(1);
+    }
+}
+
+void UdpSendBatch::OnWritable()
+{
+    if (writeNotifier)
+        writeNotifier->setEnabled(false);
+
+    int queued = count;
+    if (Flush() != queued)
+        qWarning() << "UDP: Kept datagrams dropped";
+}
+
+int UdpSendBatch::Pending() const
+{
+    return count;
+}
+
+void UdpSendBatch::SetSource(int ifindex, const QHostAddress &source)
+{
+    sourceIndex = ifindex;
+    sourceAddr = source;
+}
+
+void UdpSendBatch::Queue(const QHostAddress &addr, quint16 port,
+                         const void *header, size_t headerSize,
+                         const char *payload, size_t payloadSize)
+{
+    if (count == entries.size())
+    {
+        Flush();
+
+        // The socket is backed up, keep everything
+        if (count == entries.size())
+            Resize(count * 2);
+    }
+
+    Entry &entry = entries[count++];
+
+    entry.addr = addr;
+    entry.port = port;
+
+    if (headerSize)
+        memcpy(entry.header, header, headerSize);
+    entry.headerSize = headerSize;
+
+    entry.payload = payload;
+    entry.payloadSize = payloadSize;
+
+    entry.ifindex = sourceIndex;
+    entry.source = sourceAddr;
+
+#ifdef Q_OS_UNIX
+    entry.destLen = UdpSockAddr(sock, addr, port, &entry.dest);
+#endif
+}
+
+void UdpSendBatch::Queue(const QHostAddress &addr, quint16 port,
+                         const QByteArray &packet)
+{
+    Queue(addr, port, nullptr, 0, packet.constData(), packet.size());
+
+    // Shares the data, the pointer queued above stays valid
+    entries[count - 1].owned = packet;
+}
+
+int UdpSendBatch::Flush()
+{
+    if (count == 0)
+        return 0;
+
+    int sent = 0;
+
+#ifdef Q_OS_LINUX
+    int batched = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        Entry &entry = entries[i];
+
+        // Destination not reachable from this socket's family
+        if (!entry.destLen)
+            continue;
+
+        msgEntries[batched] = i;
+
+        iovec *iov = &iovs[batched * 2];
+        iov[0].iov_base = entry.header;
+        iov[0].iov_len = entry.headerSize;
+        iov[1].iov_base = const_cast<char*>(entry.payload);
+        iov[1].iov_len = entry.payloadSize;
+
+        mmsghdr &msg = msgs[batched++];
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_hdr.msg_name = &entry.dest;
+        msg.msg_hdr.msg_namelen = entry.destLen;
+        msg.msg_hdr.msg_iov = iov;
+        msg.msg_hdr.msg_iovlen = 2;
+
+        if ((entry.ifindex || !entry.source.isNull()) &&
+                entry.dest.ss_family == AF_INET)
+        {
+            char *space = control.data() + (batched - 1) * pktInfoSpace;
+            memset(space, 0, pktInfoSpace);
+
+            msg.msg_hdr.msg_control = space;
+            msg.msg_hdr.msg_controllen = pktInfoSpace;
+
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg.msg_hdr);
+            cmsg->cmsg_level = IPPROTO_IP;
+            cmsg->cmsg_type = IP_PKTINFO;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+
+            in_pktinfo info;
+            memset(&info, 0, sizeof(info));
+            info.ipi_ifindex = entry.ifindex;
+            info.ipi_spec_dst.s_addr = htonl(entry.source.toIPv4Address());
+            memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+        }
+    }
+
+    // sendmmsg stops at the first failure. A full socket buffer
+    // stops the batch, the rest waits until it drains. An error that
+    // belongs to one datagram only skips that one
+    int i = 0;
+    bool bufferFull = false;
+
+    while (i < batched)
+    {
+        int result = sendmmsg(sock->socketDescriptor(), msgs.data() + i,
+                              batched - i, MSG_DONTWAIT);
+        if (result > 0)
+        {
+            sent += result;
+            i += result;
+            continue;
+        }
+
+        if (result < 0 && errno == EINTR)
+            continue;
+
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            bufferFull = true;
+            break;
+        }
+
+        if (result < 0 && errno == ENOBUFS)
+            break;
+
+        ++i;
+    }
+
+    int kept = batched - i;
+    Retain(msgEntries.constData() + i, kept, bufferFull);
+#else
+    int i = 0;
+
+    for (; i < count; ++i)
+    {
+        Entry &entry = entries[i];
+
+        QByteArray packet;
+        packet.reserve(entry.headerSize + entry.payloadSize);
+        packet.append((const char*)entry.header, entry.headerSize);
+        packet.append(entry.payload, entry.payloadSize);
+
+        if (sock->writeDatagram(packet, entry.addr, entry.port) ==
+                packet.size())
+        {
+            ++sent;
+            continue;
+        }
+
+        // No write notifier to lean on here, retry on the timer
+        if (sock->error() == QAbstractSocket::TemporaryError)
+            break;
+    }
+
+    QVector<int> keep;
+    for (int n = i; n < count; ++n)
+        keep.append(n);
+
+    int kept = keep.size();
+    Retain(keep.constData(), kept, false);
+#endif
+
+    return sent + kept;
+}
@@ -0,0 +1,196 @@
+/*
+ * This file is part of PXEDHCP.
+ * Copyright 2013 A. Douglas Gale
+ *
+ * PXEDHCP is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PXEDHCP is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef UDPBATCH_H
+#define UDPBATCH_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHostAddress>
+#include <QUdpSocket>
+#include <QVector>
+
+#ifdef Q_OS_UNIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+// Receives up to a batch of datagrams with one recvmmsg call on Linux,
+// one readDatagram per datagram elsewhere. The datagrams stay valid
+// until the next Receive
+class UdpRecvBatch
+{
+    struct Slot
+    {
+        QHostAddress addr;
+        quint16 port;
+        int size;
+
+        // From IP_PKTINFO, 0 and null when not known
+        int ifindex;
+        QHostAddress local;
+    };
+
+    int slotSize;
+    QByteArray buffer;
+    QVector<Slot> datagrams;
+
+#ifdef Q_OS_LINUX
+    // recvmmsg arguments, pointing into buffer, set up once
+    QVector<mmsghdr> msgs;
+    QVector<iovec> iovs;
+    QVector<sockaddr_storage> addrs;
+
+    // Room for one IP_PKTINFO message per datagram
+    QByteArray control;
+#endif
+
+    Q_DISABLE_COPY(UdpRecvBatch)
+
+public:
+    UdpRecvBatch(int capacity, int slotSize);
+
+    // Returns the number of datagrams received, 0 when drained
+    int Receive(QUdpSocket *sock);
+
+    const char *Data(int i) const;
+
+    // Negative if the datagram didn't fit in a slot
+    int Size(int i) const;
+
+    const QHostAddress &Address(int i) const;
+    quint16 Port(int i) const;
+
+    // Interface the datagram came in on, and the local address a
+    // reply should come from. Only known on Linux, for IPv4 sockets
+    // that had EnablePacketInfo
+    int InterfaceIndex(int i) const;
+    const QHostAddress &LocalAddress(int i) const;
+
+    static bool EnablePacketInfo(QUdpSocket *sock);
+};
+
+class QSocketNotifier;
+class QTimer;
+
+// Queues outbound datagrams and sends them with one sendmmsg call on
+// Linux. A datagram is a small header plus a payload that is not
+// copied, so the payload must stay valid until Flush. What a full
+// socket buffer can't take is copied and kept, and goes out when the
+// socket is writable again
+class UdpSendBatch : public QObject
+{
+    Q_OBJECT
+
+    struct Entry
+    {
+        QHostAddress addr;
+        quint16 port;
+
+        quint8 header[4];
+        size_t headerSize;
+
+        const char *payload;
+        size_t payloadSize;
+
+        // Keeps a queued QByteArray alive, payload points into it
+        QByteArray owned;
+
+        // Outgoing interface and source address, see SetSource
+        int ifindex;
+        QHostAddress source;
+
+#ifdef Q_OS_UNIX
+        sockaddr_storage dest;
+        socklen_t destLen;
+#endif
+    };
+
+    QUdpSocket *sock;
+    QVector<Entry> entries;
+    int count;
+
+    int sourceIndex;
+    QHostAddress sourceAddr;
+
+#ifdef Q_OS_LINUX
+    QVector<mmsghdr> msgs;
+    QVector<iovec> iovs;
+    QByteArray control;
+
+    // Entry each message in msgs was built from
+    QVector<int> msgEntries;
+#endif
+
+    // Created on the flushing thread when the socket pushes back,
+    // the notifier for a full buffer, the timer for ENOBUFS
+    QSocketNotifier *writeNotifier;
+    QTimer *retryTimer;
+
+    void Resize(int capacity);
+
+    // Keeps the listed entries, copying payloads we don't own, and
+    // waits for the socket to take them. Everything else is released
+    void Retain(const int *keep, int keepCount, bool bufferFull);
+    void StopWaiting();
+
+    Q_DISABLE_COPY(UdpSendBatch)
+
+public:
+    explicit UdpSendBatch(int capacity = 1);
+    ~UdpSendBatch();
+
+    // Pending datagrams for another socket are dropped
+    void SetSocket(QUdpSocket *socket);
+    void SetCapacity(int capacity);
+
+    // Drop whatever is queued, before the socket is closed
+    void Discard();
+
+    int Pending() const;
+
+    // Datagrams queued from now on leave through this interface, from
+    // this address, with IP_PKTINFO. Needed for broadcasts from a
+    // wildcard socket on a multi-homed host. 0 and a null address
+    // leave the choice to the routing table. Linux and IPv4 only
+    void SetSource(int ifindex, const QHostAddress &source);
+
+    // A full batch is flushed before queueing, and grows if the
+    // socket could not take it
+    void Queue(const QHostAddress &addr, quint16 port,
+               const void *header, size_t headerSize,
+               const char *payload, size_t payloadSize);
+
+    void Queue(const QHostAddress &addr, quint16 port,
+               const QByteArray &packet);
+
+    // Returns the number of datagrams the kernel accepted or that
+    // are kept until the socket is writable. The difference from
+    // Pending before the call was dropped
+    int Flush();
+
+private slots:
+    void OnWritable();
+};
+
+#ifdef Q_OS_UNIX
+// Build the destination address in the socket's address family.
+// Returns 0 if the address can't be expressed in that family
+socklen_t UdpSockAddr(QUdpSocket *sock, const QHostAddress &addr,
+                      quint16 port, sockaddr_storage *dest);
+#endif
+
+#endif // UDPBATCH_H